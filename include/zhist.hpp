@@ -2,32 +2,197 @@
 #define ZHIST_HPP
 
 #include <cstdint>
+#include <deque>
 #include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <sqlite3.h>
 
 namespace fs = std::filesystem;
 
+// the [retention] section, which zhist prune applies. a limit that is not
+// set keeps everything
+struct Retention {
+    std::optional<int64_t> max_rows;
+    std::optional<int64_t> max_age_days;
+    // keeps only the newest events of each command
+    std::optional<int64_t> max_per_command;
+};
+
+// the [redaction] section. a command is stored with every token starting
+// with one of the prefixes, and every match of one of the POSIX extended
+// regular expressions, replaced by a placeholder
+struct Redaction {
+    std::vector<std::string> prefixes;
+    std::vector<std::string> patterns;
+};
+
 struct Config {
+    // the database every command but list works on, and the only one
+    // written to
     fs::path db_path;
+    // every database list reads: db_path first, then the ones matched by
+    // merge_db_paths, such as copies synced from other hosts
+    std::vector<fs::path> db_paths;
+    // how many commands the recent and the frecency lists show
     int recent_num;
+    Retention retention;
+    Redaction redaction;
 };
 
 Config get_config();
 
-inline bool is_command_valid(const std::string& cmd) {
+inline bool is_command_valid(std::string_view cmd) {
     auto pos = cmd.find_first_not_of(" \t\n\v\f\r");
-    return pos != std::string::npos && cmd[pos] != '#';
+    return pos != std::string_view::npos && cmd[pos] != '#';
 }
 
+struct HistoryEntry {
+    std::string_view command;
+    std::optional<int64_t> time;
+    std::optional<int64_t> duration;
+};
+
+// read-only mapping of a zsh history file, in either the plain or the
+// EXTENDED_HISTORY format
+class HistoryFile {
+public:
+    explicit HistoryFile(const fs::path& path);
+    ~HistoryFile();
+
+    HistoryFile(const HistoryFile&) = delete;
+    HistoryFile& operator=(const HistoryFile&) = delete;
+    HistoryFile(HistoryFile&&) = delete;
+    HistoryFile& operator=(HistoryFile&&) = delete;
+
+    // commands point into the mapping, or into storage owned by this object
+    // when they had to be unmetafied or joined, and stay valid as long as it
+    void for_each(const std::function<void(const HistoryEntry&)>& f);
+
+private:
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+    std::deque<std::string> decoded_;
+};
+
+// shared mapping of <db>.recent, a small hash table from recently added
+// (command, directory, return code) keys to the ids of their rows, so
+// that a repeated command only has to update the time of its event.
+// every operation is a no-op when the file can't be mapped
+class RecentCache {
+public:
+    struct Entry {
+        int64_t event_id;
+        int64_t command_id;
+        int64_t directory_id;
+    };
+
+    explicit RecentCache(const fs::path& db_path);
+    ~RecentCache();
+
+    RecentCache(const RecentCache&) = delete;
+    RecentCache& operator=(const RecentCache&) = delete;
+    RecentCache(RecentCache&&) = delete;
+    RecentCache& operator=(RecentCache&&) = delete;
+
+    static uint64_t key(std::string_view cmd, std::string_view dir, int code);
+
+    // forgets every entry, for when rows may have been deleted
+    void clear();
+
+    [[nodiscard]] std::optional<Entry> find(uint64_t key) const;
+    void store(uint64_t key, const Entry& entry);
+
+    // adds that were turned into a time update, and those that were not
+    void count_hit();
+    void count_miss();
+    [[nodiscard]] uint64_t hits() const;
+    [[nodiscard]] uint64_t misses() const;
+
+private:
+    struct Header;
+    struct Slot;
+
+    Header* header_ = nullptr;
+    Slot* slots_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+// the redaction rules, with the prefixes and the literal each pattern
+// starts with in one Aho-Corasick automaton. a command is scanned once
+// however many rules there are, and the alternation of the patterns is
+// only compiled and run for the few commands where a literal shows up
+class Redactor {
+public:
+    static constexpr std::string_view placeholder = "<redacted>";
+
+    explicit Redactor(const Redaction& redaction);
+    ~Redactor();
+
+    Redactor(const Redactor&) = delete;
+    Redactor& operator=(const Redactor&) = delete;
+    Redactor(Redactor&&) = delete;
+    Redactor& operator=(Redactor&&) = delete;
+
+    // the redacted command, or nothing when it holds no secret. throws
+    // when the patterns have to be compiled and one is not a valid regex
+    [[nodiscard]] std::optional<std::string> redact(std::string_view cmd);
+
+private:
+    struct Automaton;
+    struct Patterns;
+
+    std::unique_ptr<Automaton> automaton_;
+    std::unique_ptr<Patterns> patterns_;
+};
+
+// the durations of a command's runs, as a DDSketch: each bin counts the
+// durations within a fixed relative error of one value, so quantiles keep
+// that error however many runs are added, and sketches of different days
+// merge by adding their bins
+class DurationSketch {
+public:
+    void add(int64_t duration_ms);
+    void merge(const DurationSketch& other);
+
+    [[nodiscard]] uint64_t count() const;
+    // nothing when the sketch is empty
+    [[nodiscard]] std::optional<double> quantile(double q) const;
+
+    [[nodiscard]] std::string encode() const;
+    static DurationSketch decode(std::string_view data);
+
+private:
+    uint64_t zero_count_ = 0;
+    std::map<int32_t, uint64_t> bins_;
+};
+
 enum class FilterMode : uint8_t {
     All,
     Recent,
     CurrentPath,
+    Frecency,
+    // the current directory and everything below it, nearest first
+    Subtree,
 };
 
+// receives commands one by one, in the order they are listed
+using CommandVisitor = std::function<void(std::string_view)>;
+
+// also receives the value the commands are ordered by: the time for most
+// modes, the score for frecency, and for subtree a time that is lowered
+// for each directory level below the current one
+using RankedCommandVisitor = std::function<void(std::string_view, double)>;
+
 enum class ViewMode : uint8_t {
     Normal,
     Escaped,
@@ -35,33 +200,420 @@ enum class ViewMode : uint8_t {
     History,
 };
 
+// formats commands for the given view and hands them to write(2) in large
+// blocks
+class Printer {
+public:
+    Printer(int fd, ViewMode view_mode);
+    ~Printer();
+
+    Printer(const Printer&) = delete;
+    Printer& operator=(const Printer&) = delete;
+    Printer(Printer&&) = delete;
+    Printer& operator=(Printer&&) = delete;
+
+    void print(std::string_view cmd);
+    void flush();
+
+private:
+    void append_escaped(std::string_view cmd);
+
+    int fd_;
+    ViewMode view_mode_;
+    std::string buf_;
+};
+
 namespace sql {
 
-void init(sqlite3* db);
+// thrown when other writers keep the database locked for longer than the
+// busy handler backs off
+class BusyError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// resets and clears the bindings of a cached statement when it goes out of
+// scope, so it can be reused by the next call
+class Statement {
+public:
+    explicit Statement(sqlite3_stmt* stmt) : stmt_(stmt) {}
+    ~Statement() {
+        sqlite3_reset(stmt_);
+        sqlite3_clear_bindings(stmt_);
+    }
+
+    Statement(const Statement&) = delete;
+    Statement& operator=(const Statement&) = delete;
+    Statement(Statement&&) = delete;
+    Statement& operator=(Statement&&) = delete;
+
+    [[nodiscard]] sqlite3_stmt* get() const {
+        return stmt_;
+    }
+
+private:
+    sqlite3_stmt* stmt_;
+};
+
+// owns a database connection and keeps every prepared statement alive for
+// the lifetime of the connection
+class Session {
+public:
+    Session(const fs::path& db_path, int flags);
+    ~Session();
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+    Session(Session&&) = delete;
+    Session& operator=(Session&&) = delete;
+
+    [[nodiscard]] sqlite3* get() const {
+        return db_;
+    }
+
+    Statement prepare(const char* sql);
+    void exec(const char* sql);
+
+    // steps a statement that writes, throwing unless it yields a row or is
+    // done
+    int step(const Statement& stmt);
+
+private:
+    sqlite3* db_ = nullptr;
+    std::unordered_map<const char*, sqlite3_stmt*> stmts_;
+};
+
+// rolls back unless commit() is called before it goes out of scope
+class Transaction {
+public:
+    explicit Transaction(Session& session);
+    ~Transaction();
+
+    Transaction(const Transaction&) = delete;
+    Transaction& operator=(const Transaction&) = delete;
+    Transaction(Transaction&&) = delete;
+    Transaction& operator=(Transaction&&) = delete;
+
+    void commit();
+
+private:
+    Session& session_;
+    bool committed_ = false;
+};
+
+// the schema version written to PRAGMA user_version by migrate()
+constexpr int schema_version = 6;
+
+using MigrationProgress = std::function<void(std::string_view)>;
+
+int get_schema_version(Session& session);
+
+// brings the schema up to schema_version in a single transaction
+void migrate(Session& session, const MigrationProgress& report);
+
+// return the id of the command or directory, adding it when it is new
+int64_t intern_command(Session& session, std::string_view cmd);
+int64_t intern_directory(Session& session, std::string_view dir);
+
+void insert(Session& session, RecentCache& cache, const std::string& cmd,
+            const std::string& dir, int code, int64_t time,
+            std::optional<int64_t> duration);
+void insert(Session& session, std::string_view cmd,
+            std::optional<int64_t> time);
+
+// adds an event taken from another database, or moves its time forward.
+// returns whether anything changed
+bool merge_event(Session& session, int64_t command_id,
+                 std::optional<int64_t> directory_id, std::optional<int> code,
+                 std::optional<int64_t> time);
+
+// the log-space frecency weight of one run, also registered as the
+// run_score() SQL function
+double run_score(std::optional<int> code, std::optional<int64_t> time);
 
-void delete_duplicate(sqlite3* db);
+// adds one run to the aggregates in command_stats,
+// command_directory_stats, directory_stats and activity_stats
+void update_stats(Session& session, int64_t command_id,
+                  std::optional<int64_t> directory_id, std::optional<int> code,
+                  std::optional<int64_t> time);
 
-void insert(sqlite3* db, const std::string& cmd, const std::string& dir,
-            int code, int64_t time);
-void insert(sqlite3* db, const std::string& cmd);
+// adds the duration of one run to the sketch of its command and day
+void record_duration(Session& session, int64_t command_id, int64_t time,
+                     int64_t duration);
 
-std::vector<std::string> select(sqlite3* db);
-std::vector<std::string> select(sqlite3* db, const fs::path& cwd_path);
-std::vector<std::string> select(sqlite3* db, int limit);
+// what zhist stats shows, read from the aggregate tables
+struct Report {
+    struct Count {
+        std::string text;
+        int64_t count;
+    };
+
+    struct Failures {
+        std::string command;
+        int64_t failure_count;
+        // runs with a known return code
+        int64_t count;
+    };
+
+    int64_t num_commands;
+    int64_t num_directories;
+    int64_t num_runs;
+
+    std::vector<Count> top_commands;
+    std::vector<Count> top_directories;
+    std::vector<Failures> failing_commands;
+    // (hour since the epoch, runs), oldest first
+    std::vector<std::pair<int64_t, int64_t>> activity;
+
+    int64_t page_size;
+    int64_t page_count;
+    int64_t freelist_count;
+};
+
+// the top lists hold up to limit entries each
+Report report(Session& session, int limit);
+
+// a command whose runs got slower, with quantiles in ms
+struct SlowCommand {
+    std::string command;
+    int64_t baseline_count;
+    double baseline_p50;
+    double baseline_p95;
+    int64_t recent_count;
+    double recent_p50;
+    double recent_p95;
+};
+
+// compares the durations of the last num_days days with those of the
+// baseline_days days before them, slowest growth first. commands with
+// fewer than min_runs runs in either window are left out
+std::vector<SlowCommand> select_slow(Session& session, int64_t now,
+                                     int num_days, int baseline_days,
+                                     int min_runs, int limit);
+
+void select(Session& session, const RankedCommandVisitor& f);
+void select(Session& session, const fs::path& cwd_path,
+            const RankedCommandVisitor& f);
+void select(Session& session, int limit, const RankedCommandVisitor& f);
+void select_frecency(Session& session, const fs::path& cwd_path, int limit,
+                     const RankedCommandVisitor& f);
+void select_subtree(Session& session, const fs::path& cwd_path,
+                    const RankedCommandVisitor& f);
+void select(Session& session, FilterMode filter_mode, int recent_num,
+            const fs::path& cwd_path, const RankedCommandVisitor& f);
+void select(Session& session, FilterMode filter_mode, int recent_num,
+            const fs::path& cwd_path, const CommandVisitor& f);
+
+// new databases free pages as they go, older ones have to be rebuilt by a
+// full VACUUM once to do so
+bool has_incremental_vacuum(Session& session);
+void enable_incremental_vacuum(Session& session);
+
+// moves up to num_pages free pages to the end of the file and truncates
+// it. returns whether free pages are left for another call
+bool incremental_vacuum(Session& session, int num_pages);
+
+// copies the WAL back into the database and empties it, which is when
+// freed pages leave the file
+void checkpoint(Session& session);
+
+// merges up to num_pages of the search index, dropping what deleted
+// commands left behind. returns whether there was anything to merge
+bool merge_search_index(Session& session, int num_pages);
+
+// marks the events the retention policy drops and returns how many. now
+// is in milliseconds, like event times
+std::size_t mark_expired(Session& session, const Retention& retention,
+                         int64_t now);
+
+struct PruneCounts {
+    std::size_t num_events;
+    std::size_t num_commands;
+};
+
+// deletes up to limit marked events, unless they have been run again
+// since, along with the stats and commands they leave unused
+PruneCounts prune(Session& session, int limit);
+
+// matches query as a case-insensitive substring, with whitespace matching
+// anything, and ranks the results by frecency
+void search(Session& session, std::string_view query, const fs::path& cwd_path,
+            int limit, const CommandVisitor& f);
 
 }  // namespace sql
 
+// adds are appended to <db>.journal and folded into the database later, by
+// zhist compact, a list or the daemon
+namespace journal {
+
+struct Entry {
+    std::string command;
+    std::string directory;
+    int code;
+    int64_t time;
+    std::optional<int64_t> duration;
+};
+
+bool append(const fs::path& db_path, std::string_view cmd,
+            std::string_view dir, int code, int64_t time,
+            std::optional<int64_t> duration);
+
+bool pending(const fs::path& db_path);
+
+// the entries not compacted yet, oldest first
+std::vector<Entry> read(const fs::path& db_path);
+
+// inserts the journal in one transaction and removes it. returns the
+// number of entries, or nothing when another process is compacting
+std::optional<std::size_t> compact(sql::Session& session, RecentCache& cache,
+                                   const fs::path& db_path);
+
+// folds a pending journal into the database before a command reads it.
+// a database that is read-only or busy is left alone, without waiting,
+// and the journal stays for the next compaction
+void compact_pending(const fs::path& db_path);
+
+// whether a list in the mode would show the entry
+bool matches(const Entry& entry, FilterMode filter_mode,
+             const fs::path& cwd_path);
+
+// lists like sql::select, with the entries merged in
+void select(sql::Session& session, const std::vector<Entry>& entries,
+            FilterMode filter_mode, int recent_num, const fs::path& cwd_path,
+            const CommandVisitor& f);
+
+}  // namespace journal
+
+namespace merge {
+
+// lists from every database at once, each read on its own thread, and
+// merges the streams by the value they are ordered by. the first database
+// is the local one, whose journal entries are merged in as well
+void select(const std::vector<fs::path>& db_paths,
+            const std::vector<journal::Entry>& entries, FilterMode filter_mode,
+            int recent_num, const fs::path& cwd_path, const CommandVisitor& f);
+
+}  // namespace merge
+
+// a compact, versioned dump of every event, for backups and for moving
+// history between hosts. commands and directories are written once each,
+// front coded, and the events as columns of varints that refer to them
+namespace snapshot {
+
+struct Counts {
+    std::size_t num_events;
+    // events that were new to the database, or newer than its copy
+    std::size_t num_merged;
+};
+
+// encodes the whole history and returns the number of events
+std::size_t dump(sql::Session& session, std::string& data);
+
+// merges the events in transactions of batch_size events each
+Counts restore(sql::Session& session, std::string_view data, int batch_size);
+
+// read and write snapshot files, with - for stdin and stdout
+std::string load(const fs::path& path);
+void save(const fs::path& path, std::string_view data);
+
+}  // namespace snapshot
+
+namespace ipc {
+
+enum class RequestType : uint8_t {
+    // 0 was an add, which goes to the journal now
+    List = 1,
+};
+
+struct ListRequest {
+    std::string db_path;
+    FilterMode filter_mode;
+    int32_t recent_num;
+    std::string cwd;
+};
+
+// in a directory only the user can enter, made by listen_socket
+fs::path socket_path();
+int listen_socket();
+
+// whether the process at the other end of the socket runs as the user,
+// which both sides check before they trust a frame
+bool is_same_user(int fd);
+
+// buffers frames and sends them in large writes
+class FrameWriter {
+public:
+    explicit FrameWriter(int fd) : fd_(fd) {}
+
+    bool write(std::string_view payload);
+    bool flush();
+
+private:
+    int fd_;
+    std::string buf_;
+};
+
+// receives frames in large reads
+class FrameReader {
+public:
+    explicit FrameReader(int fd) : fd_(fd) {}
+
+    // the returned payload is valid until the next call
+    std::optional<std::string_view> read();
+
+private:
+    bool fill(std::size_t size);
+
+    int fd_;
+    std::string buf_;
+    std::size_t pos_ = 0;
+};
+
+bool write_frame(int fd, std::string_view payload);
+bool read_frame(int fd, std::string& payload);
+bool write_status(int fd, bool ok);
+std::optional<ListRequest> read_request(int fd);
+
+// returns false when no daemon serving db_path is reachable, or when it
+// stopped before the end of the list
+bool list(const fs::path& db_path, int recent_num, FilterMode filter_mode,
+          const fs::path& cwd_path, const CommandVisitor& f);
+
+}  // namespace ipc
+
 namespace command {
 
 int init(const fs::path& db_path);
 
-int add(const fs::path& db_path, const std::string& cmd, const std::string& dir,
-        int code);
+int add(const fs::path& db_path, const Redaction& redaction,
+        const std::string& cmd, const std::string& dir, int code,
+        std::optional<int64_t> duration);
+
+int load(const fs::path& db_path, const Redaction& redaction,
+         const std::string& history_path, int batch_size);
+
+// db_paths holds the local database first
+int list(const std::vector<fs::path>& db_paths, int recent_num,
+         FilterMode filter_mode, ViewMode view_mode);
+
+int compact(const fs::path& db_path);
+
+int stats(const fs::path& db_path, int limit, int num_days, bool is_json);
+
+int slow(const fs::path& db_path, int limit, int num_days, int baseline_days,
+         int min_runs);
+
+int prune(const fs::path& db_path, const Retention& retention,
+          int batch_size);
+
+int export_snapshot(const fs::path& db_path, const fs::path& path);
+int import_snapshot(const fs::path& db_path, const fs::path& path,
+                    int batch_size);
 
-int load(const fs::path& db_path, const std::string& history_path);
+int search(const fs::path& db_path, const std::string& query, int limit,
+           ViewMode view_mode);
 
-int list(const fs::path& db_path, int recent_num, FilterMode filter_mode,
-         ViewMode view_mode);
+int daemon(const fs::path& db_path);
 
 }  // namespace command
 
@@ -1,12 +1,22 @@
 #ifndef ZPROMPT_HPP
 #define ZPROMPT_HPP
 
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <filesystem>
 #include <format>
+#include <functional>
+#include <optional>
 #include <string>
 #include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+struct git_oid;
+struct git_repository;
+
 enum class Color : uint8_t {
     black = 0,
     red,
@@ -37,10 +47,158 @@ struct Config {
 
 Config get_config();
 
-std::string get_current_directory(const Config& config);
-std::string get_git_status(const Config& config);
-std::string get_ssh_status(const Config& config);
-std::string get_venv_status(const Config& config);
+// per-user files that don't outlive the login, such as per-session caches
+std::filesystem::path get_runtime_dir();
+// per-user files worth keeping across logins
+std::filesystem::path get_cache_dir();
+
+// the shell a prompt is for. the server gets it from the client instead of
+// its own process
+struct Context {
+    std::filesystem::path cwd;
+    int return_code;
+    std::string home;
+    std::string ssh_connection;
+    std::string virtual_env;
+    std::string virtual_env_prompt;
+};
+
+Context get_context(int return_code);
+
+// whether directories hold a marker, for as long as their mtime, which any
+// entry being added, removed or renamed changes, stays the same
+class MarkerCache {
+public:
+    struct Key {
+        uint64_t dev;
+        uint64_t ino;
+        int64_t mtime_ns;
+
+        bool operator==(const Key&) const = default;
+    };
+
+    // loaded from the file when there is one, which save() writes back
+    explicit MarkerCache(const std::vector<std::string>& markers,
+                         std::filesystem::path path = {});
+
+    // the cache of the prompts of this shell session
+    static MarkerCache for_session(const std::vector<std::string>& markers);
+
+    [[nodiscard]] std::optional<bool> find(const Key& key) const;
+    void store(const Key& key, bool has_marker);
+    void save() const;
+
+private:
+    struct KeyHash {
+        std::size_t operator()(const Key& key) const;
+    };
+
+    void load();
+
+    std::filesystem::path path_;
+    uint64_t markers_hash_;
+    std::unordered_map<Key, bool, KeyHash> entries_;
+    bool is_dirty_ = false;
+};
+
+// tells whether the prompt the work is for has been replaced by a newer one
+using CancelCheck = std::function<bool()>;
+
+std::string get_current_directory(const Config& config, const Context& context,
+                                  MarkerCache& markers);
+std::string get_git_status(const Config& config,
+                           const std::filesystem::path& cwd);
+// nothing when it was cancelled
+std::optional<std::string> get_git_status(const Config& config,
+                                          const std::filesystem::path& cwd,
+                                          const CancelCheck& is_cancelled);
+// for a repository that is open already, with libgit2 initialized
+std::optional<std::string> get_git_status(const Config& config,
+                                          git_repository* repo,
+                                          const CancelCheck& is_cancelled);
+std::string get_ssh_status(const Config& config, const Context& context);
+std::string get_venv_status(const Config& config, const Context& context);
 std::string get_return_code(const Config& config, int return_code);
 
+// times the parts of a prompt with zprompt --profile or ZPROMPT_PROFILE set,
+// and with ZPROMPT_PROFILE_HISTOGRAM set adds them to a histogram of each
+// part under the cache dir, which the table then shows percentiles of
+class Profiler {
+public:
+    // does nothing
+    Profiler() = default;
+    Profiler(bool is_printed, bool is_recorded)
+        : is_printed_(is_printed), is_recorded_(is_recorded) {}
+
+    static Profiler from_env(bool is_printed);
+
+    template <typename F>
+    auto time(const char* part, F&& f) {
+        if (!is_printed_ && !is_recorded_) {
+            return f();
+        }
+        auto start = std::chrono::steady_clock::now();
+        auto result = f();
+        timings_.emplace_back(part, std::chrono::steady_clock::now() - start);
+        return result;
+    }
+
+    // prints the table to stderr and records the histograms
+    void report() const;
+
+private:
+    bool is_printed_ = false;
+    bool is_recorded_ = false;
+    std::vector<std::pair<const char*, std::chrono::nanoseconds>> timings_;
+};
+
+std::string format_prompt(const Config& config, const Context& context,
+                          MarkerCache& markers, const std::string& git_status,
+                          Profiler& profiler);
+
+// in async mode the prompt is printed at once with the git segment last
+// seen in the directory, and a worker started by the shell prints it
+// again when the real one is known. each prompt of a shell session starts
+// a new generation, and a worker of an older one gives up
+namespace async {
+
+uint64_t begin_generation();
+std::optional<uint64_t> current_generation();
+
+std::optional<std::string> load_git_status(const std::filesystem::path& dir);
+void save_git_status(const std::filesystem::path& dir,
+                     const std::string& git_status);
+
+// removes the files of sessions and directories not seen for a while, at
+// most once a day
+void prune();
+
+}  // namespace async
+
+// the tags of each commit of a repository, from a file under the cache dir
+// that is built again once packed-refs or a directory under refs/tags has
+// changed. with thousands of tags, peeling every one of them to find those
+// of a detached HEAD takes seconds
+namespace tag_index {
+
+std::vector<std::string> find(git_repository* repo, const git_oid* oid);
+
+}  // namespace tag_index
+
+// zprompt --serve keeps the config, open repositories and the marker cache
+// of every prompt of the user, so a prompt costs a round trip on a unix
+// socket. the request is a version tag and the fields of the context, each
+// ending with a NUL, and the reply is the prompt, ending with a NUL, which
+// zsh can do itself with zsh/net/socket
+namespace server {
+
+std::filesystem::path socket_path();
+
+int serve();
+
+// nothing when no server answers
+std::optional<std::string> request(const Context& context);
+
+}  // namespace server
+
 #endif /* end of include guard: ZPROMPT_HPP */
@@ -0,0 +1,489 @@
+#include "zhist.hpp"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <argparse/argparse.hpp>
+#include <nlohmann/json.hpp>
+#include <sqlite3.h>
+
+namespace fs = std::filesystem;
+
+using json = nlohmann::json;
+using clock_type = std::chrono::steady_clock;
+using milliseconds = std::chrono::duration<double, std::milli>;
+using microseconds = std::chrono::duration<double, std::micro>;
+
+namespace {
+
+constexpr std::array words = {
+    "git", "status", "commit", "push", "pull", "checkout", "log", "diff", "ls",
+    "-la", "cd", "..", "make", "-j8", "cmake", "--build", "build", "vim",
+    "nvim", "cat", "grep", "-rn", "rg", "fd", "docker", "compose", "up", "-d",
+    "kubectl", "get", "pods", "ssh", "cargo", "test", "npm", "run", "python",
+    "-m", "pytest", "|", "head", "tail", "-f", "&&", "echo", "export", "sudo",
+    "apt", "install"};
+
+constexpr std::array filter_modes = {
+    std::pair{FilterMode::All, "all"},
+    std::pair{FilterMode::Recent, "recent"},
+    std::pair{FilterMode::CurrentPath, "current_path"},
+    std::pair{FilterMode::Frecency, "frecency"},
+    std::pair{FilterMode::Subtree, "subtree"},
+};
+
+constexpr std::array view_modes = {
+    std::pair{ViewMode::Normal, "normal"},
+    std::pair{ViewMode::Escaped, "escaped"},
+    std::pair{ViewMode::FZF, "fzf"},
+    std::pair{ViewMode::History, "history"},
+};
+
+struct Options {
+    int entries;
+    int commands;
+    int directories;
+    double skew;
+    double mean_length;
+    double multiline_ratio;
+    int adds;
+    int list_runs;
+    int batch_size;
+    unsigned int seed;
+};
+
+// ranks drawn with probability proportional to 1 / rank^skew, so a few
+// commands and directories dominate like in a real history
+std::discrete_distribution<int> zipf(int n, double skew) {
+    std::vector<double> weights(n);
+    for (int i = 0; i < n; ++i) {
+        weights[i] = 1.0 / std::pow(i + 1, skew);
+    }
+    return {weights.begin(), weights.end()};
+}
+
+class Generator {
+public:
+    explicit Generator(const Options& opts)
+        : rng_(opts.seed),
+          command_rank_(zipf(opts.commands, opts.skew)),
+          directory_rank_(zipf(opts.directories, opts.skew)) {
+        // lognormal lengths with the requested mean
+        constexpr double sigma = 0.6;
+        std::lognormal_distribution<double> length(
+            std::log(opts.mean_length) - sigma * sigma / 2, sigma);
+        std::bernoulli_distribution multiline(opts.multiline_ratio);
+        std::uniform_int_distribution<int> num_lines(2, 4);
+
+        commands_.reserve(opts.commands);
+        for (int i = 0; i < opts.commands; ++i) {
+            std::string cmd;
+            int lines = multiline(rng_) ? num_lines(rng_) : 1;
+            for (int line = 0; line < lines; ++line) {
+                if (line > 0) {
+                    cmd += '\n';
+                }
+                cmd += make_line(static_cast<std::size_t>(length(rng_)), i);
+            }
+            commands_.push_back(std::move(cmd));
+        }
+
+        directories_.reserve(opts.directories);
+        for (int i = 0; i < opts.directories; ++i) {
+            directories_.push_back("/home/bench/project" +
+                                   std::to_string(i % 16) + "/dir" +
+                                   std::to_string(i));
+        }
+    }
+
+    const std::string& command() {
+        return commands_[command_rank_(rng_)];
+    }
+
+    const std::string& directory() {
+        return directories_[directory_rank_(rng_)];
+    }
+
+    int return_code() {
+        std::bernoulli_distribution failed(0.1);
+        return failed(rng_) ? 1 : 0;
+    }
+
+    // seconds until the next command, about half a minute on average
+    int64_t gap() {
+        std::exponential_distribution<double> gap(1.0 / 30);
+        return static_cast<int64_t>(gap(rng_)) + 1;
+    }
+
+private:
+    std::string make_line(std::size_t length, int id) {
+        std::uniform_int_distribution<std::size_t> word(0, words.size() - 1);
+
+        // the id keeps every generated command distinct
+        std::string line = words[word(rng_)];
+        line += " ";
+        line += std::to_string(id);
+        while (line.size() < length) {
+            line += ' ';
+            line += words[word(rng_)];
+        }
+        return line;
+    }
+
+    std::mt19937 rng_;
+    std::discrete_distribution<int> command_rank_;
+    std::discrete_distribution<int> directory_rank_;
+    std::vector<std::string> commands_;
+    std::vector<std::string> directories_;
+};
+
+// writes the history in zsh's extended format with continuation lines
+void write_history(const fs::path& path, Generator& gen, int entries) {
+    std::ofstream out(path, std::ios::binary);
+
+    int64_t time = 1700000000;
+    for (int i = 0; i < entries; ++i) {
+        time += gen.gap();
+        out << ": " << time << ":0;";
+        for (char c : gen.command()) {
+            if (c == '\n') {
+                out << '\\';
+            }
+            out << c;
+        }
+        out << '\n';
+    }
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    auto rank = static_cast<std::size_t>(std::ceil(p * sorted.size()));
+    return sorted[std::clamp<std::size_t>(rank, 1, sorted.size()) - 1];
+}
+
+double median(std::vector<double> values) {
+    std::ranges::sort(values);
+    return percentile(values, 0.5);
+}
+
+json bench_load(const fs::path& db_path, const fs::path& history_path,
+                const Options& opts) {
+    auto start = clock_type::now();
+    if (command::init(db_path) != 0 ||
+        command::load(db_path, {}, history_path, opts.batch_size) != 0) {
+        throw std::runtime_error("load failed");
+    }
+    auto elapsed = milliseconds(clock_type::now() - start).count();
+
+    return {
+        {"entries", opts.entries},
+        {"total_ms", elapsed},
+        {"entries_per_second", opts.entries / (elapsed / 1000)},
+    };
+}
+
+// an add only appends to the journal, the process startup is not included
+json bench_append(const fs::path& db_path, Generator& gen,
+                  const Options& opts) {
+    std::vector<double> latencies;
+    latencies.reserve(opts.adds);
+
+    for (int i = 0; i < opts.adds; ++i) {
+        const auto& cmd = gen.command();
+        const auto& dir = gen.directory();
+        auto code = gen.return_code();
+
+        auto start = clock_type::now();
+        if (command::add(db_path, {}, cmd, dir, code, std::nullopt) != 0) {
+            throw std::runtime_error("add failed");
+        }
+        latencies.push_back(microseconds(clock_type::now() - start).count());
+    }
+
+    std::ranges::sort(latencies);
+
+    double sum = 0;
+    for (auto latency : latencies) {
+        sum += latency;
+    }
+
+    return {
+        {"samples", opts.adds},
+        {"mean_us", latencies.empty() ? 0 : sum / latencies.size()},
+        {"p50_us", percentile(latencies, 0.50)},
+        {"p90_us", percentile(latencies, 0.90)},
+        {"p99_us", percentile(latencies, 0.99)},
+        {"max_us", latencies.empty() ? 0 : latencies.back()},
+    };
+}
+
+// folds the journal into the database, like the daemon or the next list
+// does after the adds
+json bench_compact(const fs::path& db_path) {
+    auto start = clock_type::now();
+    sql::Session session(db_path, SQLITE_OPEN_READWRITE);
+    RecentCache cache(db_path);
+    auto num_entries = journal::compact(session, cache, db_path);
+    if (!num_entries) {
+        throw std::runtime_error("compact failed");
+    }
+    auto elapsed = milliseconds(clock_type::now() - start).count();
+
+    return {
+        {"entries", *num_entries},
+        {"total_ms", elapsed},
+    };
+}
+
+json bench_add(const fs::path& db_path, Generator& gen, const Options& opts) {
+    auto append = bench_append(db_path, gen, opts);
+    return {
+        {"append", append},
+        {"compact", bench_compact(db_path)},
+    };
+}
+
+struct ListRun {
+    double ttfb_ms;
+    double total_ms;
+    std::size_t bytes;
+};
+
+// runs the list in a child writing to a pipe, so the first byte is seen
+// exactly when the printer flushes it
+ListRun run_list(const fs::path& db_path, const fs::path& cwd_path,
+                 int recent_num, FilterMode filter_mode, ViewMode view_mode) {
+    std::array<int, 2> fds{};
+    if (pipe(fds.data()) != 0) {
+        throw std::runtime_error("can't create pipe");
+    }
+
+    auto start = clock_type::now();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error("can't fork");
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        fs::current_path(cwd_path);
+        _exit(command::list({db_path}, recent_num, filter_mode, view_mode));
+    }
+
+    close(fds[1]);
+
+    ListRun run{.ttfb_ms = 0, .total_ms = 0, .bytes = 0};
+    std::array<char, 1 << 16> buf{};
+    while (true) {
+        auto n = read(fds[0], buf.data(), buf.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        if (run.bytes == 0) {
+            run.ttfb_ms = milliseconds(clock_type::now() - start).count();
+        }
+        run.bytes += n;
+    }
+    close(fds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    run.total_ms = milliseconds(clock_type::now() - start).count();
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        throw std::runtime_error("list failed");
+    }
+
+    return run;
+}
+
+json bench_list(const fs::path& db_path, const fs::path& cwd_path,
+                const Options& opts) {
+    constexpr int recent_num = 100;
+
+    auto results = json::array();
+    for (auto [filter_mode, filter_name] : filter_modes) {
+        for (auto [view_mode, view_name] : view_modes) {
+            std::vector<double> ttfb;
+            std::vector<double> total;
+            std::size_t bytes = 0;
+
+            for (int i = 0; i < opts.list_runs; ++i) {
+                auto run = run_list(db_path, cwd_path, recent_num, filter_mode,
+                                    view_mode);
+                ttfb.push_back(run.ttfb_ms);
+                total.push_back(run.total_ms);
+                bytes = run.bytes;
+            }
+
+            results.push_back({
+                {"filter", filter_name},
+                {"view", view_name},
+                {"runs", opts.list_runs},
+                {"bytes", bytes},
+                {"ttfb_ms", median(ttfb)},
+                {"total_ms", median(total)},
+            });
+        }
+    }
+    return results;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    argparse::ArgumentParser program("zhist-bench");
+    program.add_description(
+        "benchmark zhist on a synthetic history and print the results as "
+        "json");
+
+    program.add_argument("-n", "--entries")
+        .help("number of history entries to load")
+        .default_value(100000)
+        .scan<'i', int>();
+    program.add_argument("--commands")
+        .help("number of distinct commands")
+        .default_value(20000)
+        .scan<'i', int>();
+    program.add_argument("--directories")
+        .help("number of distinct directories")
+        .default_value(200)
+        .scan<'i', int>();
+    program.add_argument("--skew")
+        .help("zipf exponent of command and directory popularity")
+        .default_value(1.1)
+        .scan<'g', double>();
+    program.add_argument("--mean-length")
+        .help("mean command length in bytes")
+        .default_value(24.0)
+        .scan<'g', double>();
+    program.add_argument("--multiline-ratio")
+        .help("fraction of commands spanning several lines")
+        .default_value(0.02)
+        .scan<'g', double>();
+    program.add_argument("--adds")
+        .help("number of add calls to time")
+        .default_value(1000)
+        .scan<'i', int>();
+    program.add_argument("--list-runs")
+        .help("runs of each list mode, the median is reported")
+        .default_value(5)
+        .scan<'i', int>();
+    program.add_argument("-b", "--batch-size")
+        .help("entries per load transaction")
+        .default_value(50000)
+        .scan<'i', int>();
+    program.add_argument("--seed")
+        .help("random seed")
+        .default_value(1)
+        .scan<'i', int>();
+    program.add_argument("--keep")
+        .help("keep the generated history and database")
+        .default_value(false)
+        .implicit_value(true);
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::exception& err) {
+        std::cerr << err.what() << '\n';
+        std::cerr << program;
+        return 1;
+    }
+
+    Options opts{
+        .entries = program.get<int>("--entries"),
+        .commands = std::max(program.get<int>("--commands"), 1),
+        .directories = std::max(program.get<int>("--directories"), 1),
+        .skew = program.get<double>("--skew"),
+        .mean_length = std::max(program.get<double>("--mean-length"), 1.0),
+        .multiline_ratio =
+            std::clamp(program.get<double>("--multiline-ratio"), 0.0, 1.0),
+        .adds = program.get<int>("--adds"),
+        .list_runs = std::max(program.get<int>("--list-runs"), 1),
+        .batch_size = program.get<int>("--batch-size"),
+        .seed = static_cast<unsigned int>(program.get<int>("--seed")),
+    };
+
+    auto work_dir = fs::temp_directory_path() /
+                    ("zhist-bench-" + std::to_string(getpid()));
+    auto history_path = work_dir / "history";
+    auto db_path = work_dir / "zhist.db";
+
+    // a running daemon serves another database and would only add a
+    // rejected round trip to every call
+    setenv("XDG_RUNTIME_DIR", work_dir.c_str(), 1);
+
+    json result;
+    int ret = 0;
+    try {
+        fs::create_directories(work_dir);
+
+        Generator gen(opts);
+        write_history(history_path, gen, opts.entries);
+
+        // lists run from a directory that exists and has history
+        auto cwd_path = work_dir / "cwd";
+        fs::create_directories(cwd_path);
+
+        result["options"] = {
+            {"entries", opts.entries},
+            {"commands", opts.commands},
+            {"directories", opts.directories},
+            {"skew", opts.skew},
+            {"mean_length", opts.mean_length},
+            {"multiline_ratio", opts.multiline_ratio},
+            {"seed", opts.seed},
+        };
+        result["load"] = bench_load(db_path, history_path, opts);
+        result["add"] = bench_add(db_path, gen, opts);
+
+        // give the current directory the most popular history
+        for (int i = 0; i < opts.adds / 10; ++i) {
+            command::add(db_path, {}, gen.command(), cwd_path, 0,
+                         std::nullopt);
+        }
+        // the lists then read the database alone, without a journal
+        bench_compact(db_path);
+        result["list"] = bench_list(db_path, cwd_path, opts);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        ret = 1;
+    }
+
+    if (!program.get<bool>("--keep")) {
+        std::error_code ec;
+        fs::remove_all(work_dir, ec);
+    }
+
+    if (ret == 0) {
+        std::cout << result.dump(2) << '\n';
+    }
+
+    return ret;
+}
@@ -0,0 +1,235 @@
+#include "zhist.hpp"
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <regex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sqlite3.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// nothing runs ANALYZE, and without statistics the planner takes every
+// table to hold about a million rows. the plans are then those of a large
+// history, whatever the size of this one
+constexpr int num_events = 20000;
+constexpr int num_commands = 2000;
+constexpr int num_directories = 100;
+
+// a day, in milliseconds like event times
+constexpr int64_t day_ms = 24 * 60 * 60 * 1000;
+
+// the text of every statement a session runs while it is alive
+class StatementRecorder {
+public:
+    explicit StatementRecorder(sql::Session& session) : db_(session.get()) {
+        sqlite3_trace_v2(db_, SQLITE_TRACE_STMT, record, this);
+    }
+    ~StatementRecorder() {
+        sqlite3_trace_v2(db_, 0, nullptr, nullptr);
+    }
+
+    StatementRecorder(const StatementRecorder&) = delete;
+    StatementRecorder& operator=(const StatementRecorder&) = delete;
+    StatementRecorder(StatementRecorder&&) = delete;
+    StatementRecorder& operator=(StatementRecorder&&) = delete;
+
+    [[nodiscard]] const std::set<std::string>& statements() const {
+        return statements_;
+    }
+
+private:
+    static int record(unsigned int /*type*/, void* ctx, void* p,
+                      void* /*x*/) {
+        auto* self = static_cast<StatementRecorder*>(ctx);
+        const char* sql = sqlite3_sql(static_cast<sqlite3_stmt*>(p));
+        if (sql != nullptr) {
+            self->statements_.insert(sql);
+        }
+        return 0;
+    }
+
+    sqlite3* db_;
+    std::set<std::string> statements_;
+};
+
+// a history shaped like a real one, with a few commands and directories
+// run far more often than the rest
+void fill(sql::Session& session, RecentCache& cache, int64_t now) {
+    std::mt19937 rng(1);
+    std::geometric_distribution<int> command_rank(8.0 / num_commands);
+    std::geometric_distribution<int> directory_rank(8.0 / num_directories);
+    std::bernoulli_distribution failed(0.1);
+    std::uniform_int_distribution<int64_t> duration(10, 10000);
+
+    sql::Transaction transaction(session);
+    auto time = now - 60 * day_ms;
+    for (int i = 0; i < num_events; ++i) {
+        auto cmd = "command " + std::to_string(command_rank(rng) %
+                                               num_commands);
+        auto dir = "/home/user/dir" +
+                   std::to_string(directory_rank(rng) % num_directories);
+        time += 60 * day_ms / num_events;
+        sql::insert(session, cache, cmd, dir, failed(rng) ? 1 : 0, time,
+                    duration(rng));
+    }
+    transaction.commit();
+}
+
+// the names a statement refers to the events table by
+std::set<std::string> events_names(const std::string& sql) {
+    std::set<std::string> names = {"events"};
+    static const std::regex alias(R"(\bevents\s+AS\s+(\w+))",
+                                  std::regex::icase);
+    for (std::sregex_iterator it(sql.begin(), sql.end(), alias), end;
+         it != end; ++it) {
+        names.insert((*it)[1]);
+    }
+    return names;
+}
+
+// prints the plan of every statement run and returns whether none of them
+// scans the events table, and they sort in temporary b-trees no more than
+// num_sorts times
+bool check(sql::Session& session, std::string_view name, int num_sorts,
+           const std::function<void()>& run) {
+    std::set<std::string> statements;
+    {
+        StatementRecorder recorder(session);
+        run();
+        statements = recorder.statements();
+    }
+
+    bool ok = true;
+    int num_found_sorts = 0;
+    for (const auto& sql : statements) {
+        auto events = events_names(sql);
+
+        auto plan = "EXPLAIN QUERY PLAN " + sql;
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(session.get(), plan.c_str(), -1, &stmt,
+                               nullptr) != SQLITE_OK) {
+            std::cerr << name << ": " << sqlite3_errmsg(session.get())
+                      << '\n';
+            return false;
+        }
+
+        std::cout << name << ':' << sql << '\n';
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            std::string detail = reinterpret_cast<const char*>(
+                sqlite3_column_text(stmt, 3));
+            std::cout << "    " << detail << '\n';
+
+            auto table = detail.starts_with("SCAN ")
+                             ? detail.substr(5, detail.find(' ', 5) - 5)
+                             : std::string();
+            if (events.contains(table)) {
+                std::cerr << name << ": " << detail << '\n';
+                ok = false;
+            }
+            if (detail.starts_with("USE TEMP B-TREE")) {
+                ++num_found_sorts;
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    if (num_found_sorts > num_sorts) {
+        std::cerr << name << ": " << num_found_sorts
+                  << " temp b-tree sorts, expected " << num_sorts << '\n';
+        ok = false;
+    }
+    return ok;
+}
+
+}  // namespace
+
+// runs the list, search and stats queries on a synthetic database and
+// fails when a plan scans every event or sorts where an index should
+int main() {
+    auto dir = fs::temp_directory_path() /
+               ("zhist-query-plans-" + std::to_string(getpid()));
+    fs::create_directories(dir);
+    auto db_path = dir / "zhist.db";
+
+    bool ok = true;
+    try {
+        auto now = int64_t{1700000000} * 1000;
+        fs::path cwd_path = "/home/user/dir1";
+
+        sql::Session session(db_path,
+                             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+        sql::migrate(session, [](std::string_view) {});
+        {
+            RecentCache cache(db_path);
+            fill(session, cache, now);
+        }
+
+        // statistics would tie the plans to the size of this history
+        if (sqlite3_table_column_metadata(session.get(), "main",
+                                          "sqlite_stat1", nullptr, nullptr,
+                                          nullptr, nullptr, nullptr,
+                                          nullptr) == SQLITE_OK) {
+            throw std::runtime_error("sqlite_stat1 exists");
+        }
+
+        auto ignore = [](std::string_view) {};
+        constexpr int limit = 100;
+
+        // the sorts counted are the ones that can't come from an index:
+        // they order the few rows a query has already picked, by a value
+        // computed for them
+        ok &= check(session, "list all", 0, [&] {
+            sql::select(session, FilterMode::All, limit, cwd_path, ignore);
+        });
+        // the newest commands, put back in the order they were run
+        ok &= check(session, "list recent", 1, [&] {
+            sql::select(session, FilterMode::Recent, limit, cwd_path,
+                        ignore);
+        });
+        ok &= check(session, "list current path", 0, [&] {
+            sql::select(session, FilterMode::CurrentPath, limit, cwd_path,
+                        ignore);
+        });
+        // the best scores, ranked again with the bonus of the directory
+        ok &= check(session, "list frecency", 1, [&] {
+            sql::select(session, FilterMode::Frecency, limit, cwd_path,
+                        ignore);
+        });
+        // the runs in the subtree grouped by command, then ranked
+        ok &= check(session, "list subtree", 2, [&] {
+            sql::select(session, FilterMode::Subtree, limit, "/home/user",
+                        ignore);
+        });
+        // the matches grouped by command, then ranked
+        ok &= check(session, "search", 2, [&] {
+            sql::search(session, "command 1", cwd_path, limit, ignore);
+        });
+        ok &= check(session, "stats", 0,
+                    [&] { sql::report(session, limit); });
+        // the commands ranked by how much slower they got
+        ok &= check(session, "slow", 1, [&] {
+            sql::select_slow(session, now, 7, 30, 1, limit);
+        });
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        ok = false;
+    }
+
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+
+    return ok ? 0 : 1;
+}
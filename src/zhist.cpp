@@ -1,5 +1,6 @@
 #include "zhist.hpp"
 
+#include <cstdint>
 #include <exception>
 #include <iostream>
 #include <string>
@@ -21,10 +22,17 @@ int main(int argc, char* argv[]) {
         .help("return code")
         .scan<'i', int>()
         .required();
+    add_command.add_argument("--duration-ms")
+        .help("how long the command ran, in milliseconds")
+        .scan<'i', int64_t>();
 
     argparse::ArgumentParser load_command("load");
     load_command.add_description("load history file to database");
     load_command.add_argument("filename").help("history file name");
+    load_command.add_argument("-b", "--batch-size")
+        .help("number of commands per transaction")
+        .scan<'i', int>()
+        .default_value(50000);
 
     argparse::ArgumentParser list_command("list");
     list_command.add_description("list history");
@@ -34,7 +42,18 @@ int main(int argc, char* argv[]) {
         .default_value(false)
         .implicit_value(true);
     filter_group.add_argument("-r", "--recent")
-        .help("list recent success commands")
+        .help("list recent success commands, as many as recent_num in the "
+              "config")
+        .default_value(false)
+        .implicit_value(true);
+    filter_group.add_argument("-f", "--frecency")
+        .help("list frequent and recent commands, best first, as many as "
+              "recent_num in the config")
+        .default_value(false)
+        .implicit_value(true);
+    filter_group.add_argument("-s", "--subtree")
+        .help("list success commands of this directory and below, nearest "
+              "first")
         .default_value(false)
         .implicit_value(true);
 
@@ -52,10 +71,97 @@ int main(int argc, char* argv[]) {
         .default_value(false)
         .implicit_value(true);
 
+    argparse::ArgumentParser search_command("search");
+    search_command.add_description("search history by substring");
+    search_command.add_argument("query").help("words to search for");
+    search_command.add_argument("-n", "--limit")
+        .help("maximum number of results")
+        .scan<'i', int>()
+        .default_value(50);
+    auto& search_view_group = search_command.add_mutually_exclusive_group();
+    search_view_group.add_argument("-e", "--escape")
+        .help("escape special charactors")
+        .default_value(false)
+        .implicit_value(true);
+    search_view_group.add_argument("--fzf")
+        .help("list commands for fzf --read0 --delimiter='\\t' --with-nth=1")
+        .default_value(false)
+        .implicit_value(true);
+
+    argparse::ArgumentParser compact_command("compact");
+    compact_command.add_description(
+        "fold the journal of recent adds into the database");
+
+    argparse::ArgumentParser stats_command("stats");
+    stats_command.add_description("show statistics of the history");
+    stats_command.add_argument("-n", "--limit")
+        .help("number of entries in each top list")
+        .scan<'i', int>()
+        .default_value(10);
+    stats_command.add_argument("--days")
+        .help("number of days in the daily activity")
+        .scan<'i', int>()
+        .default_value(30);
+    stats_command.add_argument("--json")
+        .help("print the statistics as JSON")
+        .default_value(false)
+        .implicit_value(true);
+
+    argparse::ArgumentParser slow_command("slow");
+    slow_command.add_description(
+        "show commands that got slower than they used to be");
+    slow_command.add_argument("-n", "--limit")
+        .help("number of commands to show")
+        .scan<'i', int>()
+        .default_value(20);
+    slow_command.add_argument("--days")
+        .help("number of recent days compared with the baseline")
+        .scan<'i', int>()
+        .default_value(7);
+    slow_command.add_argument("--baseline-days")
+        .help("number of days before them that make the baseline")
+        .scan<'i', int>()
+        .default_value(28);
+    slow_command.add_argument("--min-runs")
+        .help("runs a command needs in each period to be compared")
+        .scan<'i', int>()
+        .default_value(5);
+
+    argparse::ArgumentParser prune_command("prune");
+    prune_command.add_description(
+        "delete history beyond the [retention] limits of the config");
+    prune_command.add_argument("-b", "--batch-size")
+        .help("number of events deleted per transaction")
+        .scan<'i', int>()
+        .default_value(10000);
+
+    argparse::ArgumentParser export_command("export");
+    export_command.add_description("write a compact snapshot of the history");
+    export_command.add_argument("filename").help("snapshot file, - for stdout");
+
+    argparse::ArgumentParser import_command("import");
+    import_command.add_description("merge a snapshot into the database");
+    import_command.add_argument("filename").help("snapshot file, - for stdin");
+    import_command.add_argument("-b", "--batch-size")
+        .help("number of events per transaction")
+        .scan<'i', int>()
+        .default_value(50000);
+
+    argparse::ArgumentParser daemon_command("daemon");
+    daemon_command.add_description("serve list requests over a unix socket");
+
     program.add_subparser(init_command);
     program.add_subparser(add_command);
     program.add_subparser(load_command);
     program.add_subparser(list_command);
+    program.add_subparser(search_command);
+    program.add_subparser(compact_command);
+    program.add_subparser(stats_command);
+    program.add_subparser(slow_command);
+    program.add_subparser(prune_command);
+    program.add_subparser(export_command);
+    program.add_subparser(import_command);
+    program.add_subparser(daemon_command);
 
     try {
         program.parse_args(argc, argv);
@@ -75,37 +181,104 @@ int main(int argc, char* argv[]) {
         auto cmd = add_command.get<std::string>("--command");
         auto dir = add_command.get<std::string>("--directory");
         auto ret = add_command.get<int>("--return-code");
+        auto duration = add_command.present<int64_t>("--duration-ms");
 
-        return command::add(config.db_path, cmd, dir, ret);
+        return command::add(config.db_path, config.redaction, cmd, dir, ret,
+                            duration);
     }
 
     if (program.is_subcommand_used("load")) {
         auto filename = load_command.get<std::string>("filename");
+        auto batch_size = load_command.get<int>("--batch-size");
 
-        return command::load(config.db_path, filename);
+        return command::load(config.db_path, config.redaction, filename,
+                             batch_size);
     }
 
     if (program.is_subcommand_used("list")) {
         auto is_all = list_command.get<bool>("--all");
         auto is_recent = list_command.get<bool>("--recent");
+        auto is_frecency = list_command.get<bool>("--frecency");
+        auto is_subtree = list_command.get<bool>("--subtree");
 
         auto is_escaped = list_command.get<bool>("--escape");
         auto is_fzf = list_command.get<bool>("--fzf");
         auto is_history = list_command.get<bool>("--zsh-history");
 
-        auto filter_mode = is_all      ? FilterMode::All
-                           : is_recent ? FilterMode::Recent
-                                       : FilterMode::CurrentPath;
+        auto filter_mode = is_all        ? FilterMode::All
+                           : is_recent   ? FilterMode::Recent
+                           : is_frecency ? FilterMode::Frecency
+                           : is_subtree  ? FilterMode::Subtree
+                                         : FilterMode::CurrentPath;
 
         auto view_mode = is_escaped   ? ViewMode::Escaped
                          : is_fzf     ? ViewMode::FZF
                          : is_history ? ViewMode::History
                                       : ViewMode::Normal;
 
-        return command::list(config.db_path, config.recent_num, filter_mode,
+        return command::list(config.db_paths, config.recent_num, filter_mode,
                              view_mode);
     }
 
+    if (program.is_subcommand_used("search")) {
+        auto query = search_command.get<std::string>("query");
+        auto limit = search_command.get<int>("--limit");
+
+        auto is_escaped = search_command.get<bool>("--escape");
+        auto is_fzf = search_command.get<bool>("--fzf");
+
+        auto view_mode = is_escaped ? ViewMode::Escaped
+                         : is_fzf   ? ViewMode::FZF
+                                    : ViewMode::Normal;
+
+        return command::search(config.db_path, query, limit, view_mode);
+    }
+
+    if (program.is_subcommand_used("compact")) {
+        return command::compact(config.db_path);
+    }
+
+    if (program.is_subcommand_used("stats")) {
+        auto limit = stats_command.get<int>("--limit");
+        auto num_days = stats_command.get<int>("--days");
+        auto is_json = stats_command.get<bool>("--json");
+
+        return command::stats(config.db_path, limit, num_days, is_json);
+    }
+
+    if (program.is_subcommand_used("slow")) {
+        auto limit = slow_command.get<int>("--limit");
+        auto num_days = slow_command.get<int>("--days");
+        auto baseline_days = slow_command.get<int>("--baseline-days");
+        auto min_runs = slow_command.get<int>("--min-runs");
+
+        return command::slow(config.db_path, limit, num_days, baseline_days,
+                             min_runs);
+    }
+
+    if (program.is_subcommand_used("prune")) {
+        auto batch_size = prune_command.get<int>("--batch-size");
+
+        return command::prune(config.db_path, config.retention, batch_size);
+    }
+
+    if (program.is_subcommand_used("export")) {
+        auto filename = export_command.get<std::string>("filename");
+
+        return command::export_snapshot(config.db_path, filename);
+    }
+
+    if (program.is_subcommand_used("import")) {
+        auto filename = import_command.get<std::string>("filename");
+        auto batch_size = import_command.get<int>("--batch-size");
+
+        return command::import_snapshot(config.db_path, filename, batch_size);
+    }
+
+    if (program.is_subcommand_used("daemon")) {
+        return command::daemon(config.db_path);
+    }
+
     std::cerr << program;
     return 1;
 }
@@ -1,9 +1,11 @@
 #include "zhist.hpp"
 
 #include <chrono>
+#include <cstdint>
 #include <exception>
 #include <filesystem>
 #include <iostream>
+#include <optional>
 #include <string>
 
 #include <sqlite3.h>
@@ -15,28 +17,34 @@ using std::chrono::duration_cast;
 
 namespace command {
 
-int add(const fs::path& db_path, const std::string& cmd, const std::string& dir,
-        int code) {
+int add(const fs::path& db_path, const Redaction& redaction,
+        const std::string& cmd, const std::string& dir, int code,
+        std::optional<int64_t> duration) {
     try {
         if (!is_command_valid(cmd)) {
             return 0;
         }
 
+        // a rule that can't be compiled fails the add rather than let a
+        // secret through
+        Redactor redactor(redaction);
+        auto redacted = redactor.redact(cmd);
+        const auto& safe_cmd = redacted ? *redacted : cmd;
+
         auto now = std::chrono::system_clock::now();
         auto time = duration_cast<ms>(now.time_since_epoch()).count();
 
-        sqlite3* db = nullptr;
-        int rc = sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READWRITE,
-                                 nullptr);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Can't open database: " << sqlite3_errmsg(db) << '\n';
-            sqlite3_close(db);
-            return 1;
+        if (journal::append(db_path, safe_cmd, dir, code, time, duration)) {
+            return 0;
         }
 
-        sql::insert(db, cmd, dir, code, time);
+        // the journal can't be written, so the add goes to the database
+        sql::Session session(db_path, SQLITE_OPEN_READWRITE);
+        RecentCache cache(db_path);
 
-        sqlite3_close(db);
+        sql::Transaction transaction(session);
+        sql::insert(session, cache, safe_cmd, dir, code, time, duration);
+        transaction.commit();
     } catch (const std::exception& e) {
         std::cerr << e.what() << '\n';
         return 1;
@@ -0,0 +1,33 @@
+#include "zhist.hpp"
+
+#include <exception>
+#include <filesystem>
+#include <iostream>
+
+#include <sqlite3.h>
+
+namespace fs = std::filesystem;
+
+namespace command {
+
+int compact(const fs::path& db_path) {
+    try {
+        sql::Session session(db_path, SQLITE_OPEN_READWRITE);
+        RecentCache cache(db_path);
+
+        auto num_entries = journal::compact(session, cache, db_path);
+        if (!num_entries) {
+            std::cerr << "another process is compacting the journal\n";
+            return 1;
+        }
+
+        std::cerr << "compacted " << *num_entries << " journal entries\n";
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
+
+}  // namespace command
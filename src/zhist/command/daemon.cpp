@@ -0,0 +1,272 @@
+#include "zhist.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <sqlite3.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr auto sql_data_version = R"sql(
+    PRAGMA data_version
+)sql";
+
+// how often the journal written by zhist add is folded into the database
+constexpr auto compact_interval = std::chrono::seconds(1);
+
+// the most recent commands kept in memory. longer recent lists are read
+// from the database
+constexpr int max_recent = 1000;
+
+// a client gets this long to send its request, and each write of a list
+// to go through, so one that stalls can't hold up the others for long
+constexpr auto request_timeout = std::chrono::milliseconds(200);
+constexpr auto send_timeout = std::chrono::seconds(1);
+
+constexpr int poll_timeout_ms = 500;
+
+std::atomic<bool> stop_requested = false;
+
+void request_stop(int /*signum*/) {
+    stop_requested = true;
+}
+
+template <typename Duration>
+void set_timeout(int fd, int option, Duration duration) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration)
+                  .count();
+    timeval tv = {.tv_sec = us / 1000000, .tv_usec = us % 1000000};
+    setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv));
+}
+
+// thrown when a client stops reading its list
+struct ClientGone {};
+
+class Daemon {
+public:
+    explicit Daemon(const fs::path& db_path)
+        : db_path_(db_path),
+          session_(db_path, SQLITE_OPEN_READWRITE),
+          cache_(db_path) {}
+
+    void run(int listen_fd);
+
+private:
+    void handle(int fd);
+    void list(int fd, const ipc::ListRequest& req);
+
+    void compact_loop(const std::stop_token& stop);
+
+    // must be called with session_mutex_ held
+    void compact();
+    int64_t data_version();
+    void load_recent();
+
+    std::string db_path_;
+
+    std::mutex session_mutex_;
+    sql::Session session_;
+    RecentCache cache_;
+
+    // the newest commands that succeeded, oldest first like a recent
+    // list. it is read again once the database has changed since, by a
+    // compaction here or by another process
+    std::vector<std::string> recent_;
+    bool is_recent_valid_ = false;
+    int64_t recent_data_version_ = 0;
+};
+
+void Daemon::run(int listen_fd) {
+    // stopped and joined however run is left
+    std::jthread compactor(
+        [this](const std::stop_token& stop) { compact_loop(stop); });
+
+    pollfd pfd = {.fd = listen_fd, .events = POLLIN, .revents = 0};
+    while (!stop_requested) {
+        if (poll(&pfd, 1, poll_timeout_ms) <= 0) {
+            continue;
+        }
+
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        if (!ipc::is_same_user(fd)) {
+            close(fd);
+            continue;
+        }
+        set_timeout(fd, SO_RCVTIMEO, request_timeout);
+        set_timeout(fd, SO_SNDTIMEO, send_timeout);
+
+        // a failed request is dropped, the client falls back to the database
+        try {
+            handle(fd);
+        } catch (const ClientGone&) {
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+        }
+        close(fd);
+    }
+}
+
+void Daemon::handle(int fd) {
+    if (auto req = ipc::read_request(fd)) {
+        list(fd, *req);
+    }
+}
+
+void Daemon::list(int fd, const ipc::ListRequest& req) {
+    if (req.db_path != db_path_) {
+        ipc::write_status(fd, false);
+        return;
+    }
+
+    if (!ipc::write_status(fd, true)) {
+        return;
+    }
+
+    ipc::FrameWriter writer(fd);
+    auto send = [&](std::string_view cmd) {
+        if (!writer.write(cmd)) {
+            throw ClientGone();
+        }
+    };
+
+    {
+        std::lock_guard lock(session_mutex_);
+
+        // the journal must be visible to the list
+        compact();
+
+        auto entries = journal::read(db_path_);
+        if (!entries.empty()) {
+            journal::select(session_, entries, req.filter_mode,
+                            req.recent_num, fs::path(req.cwd), send);
+        } else if (req.filter_mode == FilterMode::Recent &&
+                   req.recent_num >= 0 && req.recent_num <= max_recent) {
+            if (!is_recent_valid_ || data_version() != recent_data_version_) {
+                load_recent();
+            }
+            auto num = std::min<std::size_t>(req.recent_num, recent_.size());
+            std::for_each(recent_.end() - static_cast<std::ptrdiff_t>(num),
+                          recent_.end(), send);
+        } else {
+            sql::select(session_, req.filter_mode, req.recent_num,
+                        fs::path(req.cwd), send);
+        }
+    }
+
+    // an empty frame marks the end of the list
+    send("");
+    if (!writer.flush()) {
+        throw ClientGone();
+    }
+}
+
+void Daemon::compact_loop(const std::stop_token& stop) {
+    std::mutex mutex;
+    std::condition_variable_any cv;
+
+    std::unique_lock lock(mutex);
+    while (!cv.wait_for(lock, stop, compact_interval,
+                        [&stop] { return stop.stop_requested(); })) {
+        std::lock_guard session_lock(session_mutex_);
+        compact();
+
+        // read ahead of the next list, which then doesn't wait for it
+        try {
+            if (!is_recent_valid_ || data_version() != recent_data_version_) {
+                load_recent();
+            }
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+        }
+    }
+}
+
+void Daemon::compact() {
+    // a busy database leaves the journal for the next round
+    try {
+        if (journal::pending(db_path_)) {
+            auto num = journal::compact(session_, cache_, db_path_);
+            // the data version only counts commits of other connections
+            if (num.value_or(0) > 0) {
+                is_recent_valid_ = false;
+            }
+        }
+    } catch (const sql::BusyError&) {
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+    }
+}
+
+int64_t Daemon::data_version() {
+    auto stmt = session_.prepare(sql_data_version);
+    return sqlite3_step(stmt.get()) == SQLITE_ROW
+               ? sqlite3_column_int64(stmt.get(), 0)
+               : 0;
+}
+
+void Daemon::load_recent() {
+    is_recent_valid_ = false;
+    recent_.clear();
+
+    recent_data_version_ = data_version();
+    sql::select(session_, FilterMode::Recent, max_recent, fs::path(),
+                [this](std::string_view cmd) { recent_.emplace_back(cmd); });
+    is_recent_valid_ = true;
+}
+
+}  // namespace
+namespace command {
+
+int daemon(const fs::path& db_path) {
+    int listen_fd = ipc::listen_socket();
+    if (listen_fd < 0) {
+        std::cerr << "can't listen on " << ipc::socket_path().string()
+                  << '\n';
+        return 1;
+    }
+
+    struct sigaction sa = {};
+    sa.sa_handler = request_stop;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    int ret = 0;
+    try {
+        Daemon daemon(db_path);
+        daemon.run(listen_fd);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        ret = 1;
+    }
+
+    close(listen_fd);
+    unlink(ipc::socket_path().c_str());
+
+    return ret;
+}
+
+}  // namespace command
@@ -0,0 +1,50 @@
+#include "zhist.hpp"
+
+#include <chrono>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include <sqlite3.h>
+
+namespace fs = std::filesystem;
+
+using seconds = std::chrono::duration<double>;
+
+namespace command {
+
+int export_snapshot(const fs::path& db_path, const fs::path& path) {
+    auto start = std::chrono::steady_clock::now();
+
+    std::size_t num_events = 0;
+    std::string data;
+
+    try {
+        // the journal is folded in first, so the snapshot has every add
+        journal::compact_pending(db_path);
+
+        sql::Session session(db_path, SQLITE_OPEN_READWRITE);
+
+        // the tables are read in one transaction, so they agree
+        {
+            sql::Transaction transaction(session);
+            num_events = snapshot::dump(session, data);
+            transaction.commit();
+        }
+
+        snapshot::save(path, data);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    auto elapsed = seconds(std::chrono::steady_clock::now() - start).count();
+
+    std::cerr << "exported " << num_events << " events in " << data.size()
+              << " bytes in " << elapsed << "s\n";
+
+    return 0;
+}
+
+}  // namespace command
@@ -0,0 +1,41 @@
+#include "zhist.hpp"
+
+#include <chrono>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include <sqlite3.h>
+
+namespace fs = std::filesystem;
+
+using seconds = std::chrono::duration<double>;
+
+namespace command {
+
+int import_snapshot(const fs::path& db_path, const fs::path& path,
+                    int batch_size) {
+    auto start = std::chrono::steady_clock::now();
+
+    snapshot::Counts counts = {};
+
+    try {
+        auto data = snapshot::load(path);
+
+        sql::Session session(db_path, SQLITE_OPEN_READWRITE);
+        counts = snapshot::restore(session, data, batch_size);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    auto elapsed = seconds(std::chrono::steady_clock::now() - start).count();
+
+    std::cerr << "imported " << counts.num_merged << " of " << counts.num_events
+              << " events in " << elapsed << "s\n";
+
+    return 0;
+}
+
+}  // namespace command
@@ -1,7 +1,9 @@
 #include "zhist.hpp"
 
+#include <exception>
 #include <filesystem>
 #include <iostream>
+#include <string_view>
 
 #include <sqlite3.h>
 
@@ -16,20 +18,26 @@ int init(const fs::path& db_path) {
         fs::create_directory(db_dir);
     }
 
-    sqlite3* db = nullptr;
-    int rc =
-        sqlite3_open_v2(db_path.c_str(), &db,
-                        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
-    if (rc != SQLITE_OK) {
-        std::cerr << "Can't open database: " << sqlite3_errmsg(db) << '\n';
-        sqlite3_close(db);
+    try {
+        sql::Session session(db_path,
+                             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+
+        // a new database is set up to free pages as it shrinks
+        if (sql::get_schema_version(session) == 0 &&
+            !sql::has_incremental_vacuum(session)) {
+            sql::enable_incremental_vacuum(session);
+        }
+
+        if (sql::get_schema_version(session) < sql::schema_version) {
+            sql::migrate(session, [](std::string_view step) {
+                std::cerr << "migrating database: " << step << '\n';
+            });
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
         return 1;
     }
 
-    sql::init(db);
-
-    sqlite3_close(db);
-
     return 0;
 }
 
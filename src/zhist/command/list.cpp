@@ -1,9 +1,11 @@
 #include "zhist.hpp"
 
+#include <unistd.h>
+
+#include <cstddef>
+#include <exception>
 #include <filesystem>
 #include <iostream>
-#include <ranges>
-#include <string>
 #include <string_view>
 #include <vector>
 
@@ -11,89 +13,64 @@
 
 namespace fs = std::filesystem;
 
-namespace {
+namespace command {
 
-std::string escape_newlines(std::string_view src) {
-    constexpr int margin_newline = 10;
+int list(const std::vector<fs::path>& db_paths, int recent_num,
+         FilterMode filter_mode, ViewMode view_mode) {
+    Printer printer(STDOUT_FILENO, view_mode);
+
+    // the commands a daemon sent before it failed aren't printed again by
+    // the fallback, which lists them in the same order
+    std::size_t num_skipped = 0;
+    auto print = [&](std::string_view cmd) {
+        if (num_skipped > 0) {
+            --num_skipped;
+            return;
+        }
+        printer.print(cmd);
+    };
+
+    const auto& db_path = db_paths.front();
+
+    try {
+        auto cwd_path = fs::current_path();
+
+        // the daemon only serves the local database
+        std::size_t num_served = 0;
+        auto print_served = [&](std::string_view cmd) {
+            ++num_served;
+            printer.print(cmd);
+        };
+        if (db_paths.size() == 1 && ipc::list(db_path, recent_num, filter_mode,
+                                              cwd_path, print_served)) {
+            return 0;
+        }
+        num_skipped = num_served;
 
-    std::string escaped;
-    escaped.reserve(src.size() + margin_newline);
+        // the journal is folded in when the database is free, and merged
+        // into the list otherwise
+        journal::compact_pending(db_path);
 
-    for (char c : src) {
-        if (c == '\n') {
-            escaped.append("\\n");
-        } else if (c == '\t') {
-            escaped.append("\\t");
-        } else {
-            escaped.push_back(c);
+        auto entries = journal::read(db_path);
+        if (db_paths.size() > 1) {
+            merge::select(db_paths, entries, filter_mode, recent_num,
+                          cwd_path, print);
+            return 0;
         }
-    }
-
-    return escaped;
-}
 
-}  // namespace
+        sql::Session session(db_path, SQLITE_OPEN_READONLY);
 
-namespace command {
-
-int list(const fs::path& db_path, int recent_num, FilterMode filter_mode,
-         ViewMode view_mode) {
-    sqlite3* db = nullptr;
-    int rc =
-        sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr);
-    if (rc != SQLITE_OK) {
-        std::cerr << "Can't open database: " << sqlite3_errmsg(db) << '\n';
-        sqlite3_close(db);
+        if (entries.empty()) {
+            sql::select(session, filter_mode, recent_num, cwd_path, print);
+        } else {
+            journal::select(session, entries, filter_mode, recent_num,
+                            cwd_path, print);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
         return 1;
     }
 
-    std::vector<std::string> cmds;
-    switch (filter_mode) {
-        case FilterMode::All: {
-            cmds = sql::select(db);
-        } break;
-        case FilterMode::Recent: {
-            cmds = sql::select(db, recent_num);
-        } break;
-        case FilterMode::CurrentPath: {
-            auto cwd_path = fs::current_path();
-
-            cmds = sql::select(db, cwd_path);
-        } break;
-    }
-
-    sqlite3_close(db);
-
-    auto view_no_multiline = std::views::filter([](const std::string& s) {
-        return s.find('\n') == std::string::npos;
-    });
-
-    switch (view_mode) {
-        case ViewMode::Normal: {
-            for (const auto& cmd : cmds | std::views::reverse) {
-                std::cout << cmd << '\n';
-            }
-        } break;
-        case ViewMode::Escaped: {
-            for (const auto& cmd : cmds | std::views::reverse) {
-                std::cout << escape_newlines(cmd) << '\n';
-            }
-        } break;
-        case ViewMode::FZF: {
-            for (const auto& cmd : cmds | std::views::reverse) {
-                std::cout << escape_newlines(cmd) << '\t' << cmd << '\0';
-            }
-        } break;
-        case ViewMode::History: {
-            for (const auto& cmd :
-                 cmds | std::views::reverse | view_no_multiline) {
-                std::cout << cmd << '\n';
-            }
-        } break;
-    }
-
-    std::cout << std::flush;
-
     return 0;
 }
 
@@ -1,40 +1,85 @@
 #include "zhist.hpp"
 
-#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <exception>
 #include <iostream>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <sqlite3.h>
 
+using seconds = std::chrono::duration<double>;
+
 namespace command {
 
-int load(const fs::path& db_path, const std::string& history_path) {
-    std::ifstream ifs(history_path);
-    if (!ifs) {
-        std::cerr << "can't open file\n";
+int load(const fs::path& db_path, const Redaction& redaction,
+         const std::string& history_path, int batch_size) {
+    batch_size = std::max(batch_size, 1);
 
-        return 1;
-    }
+    auto start = std::chrono::steady_clock::now();
 
-    sqlite3* db = nullptr;
-    int rc =
-        sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READWRITE, nullptr);
-    if (rc != SQLITE_OK) {
-        std::cerr << "Can't open database: " << sqlite3_errmsg(db) << '\n';
-        sqlite3_close(db);
-        return 1;
-    }
+    std::size_t num_entries = 0;
+    std::vector<std::pair<std::string_view, std::optional<int64_t>>> cmds;
+
+    try {
+        HistoryFile history(history_path);
+        Redactor redactor(redaction);
+
+        // the commands point into the history file, or into redacted for
+        // those that held a secret
+        std::deque<std::string> redacted;
 
-    std::string cmd;
-    while (std::getline(ifs, cmd)) {
-        if (is_command_valid(cmd)) {
-            sql::insert(db, cmd);
+        // keep only the latest time of each command
+        std::unordered_map<std::string_view, std::optional<int64_t>> latest;
+        history.for_each([&](const HistoryEntry& entry) {
+            ++num_entries;
+            if (!is_command_valid(entry.command)) {
+                return;
+            }
+
+            std::string_view cmd = entry.command;
+            if (auto safe_cmd = redactor.redact(cmd)) {
+                cmd = redacted.emplace_back(std::move(*safe_cmd));
+            }
+
+            auto [it, inserted] = latest.try_emplace(cmd, entry.time);
+            if (!inserted && entry.time && it->second < entry.time) {
+                it->second = entry.time;
+            }
+        });
+
+        cmds.assign(latest.begin(), latest.end());
+        std::ranges::sort(cmds);
+
+        sql::Session session(db_path, SQLITE_OPEN_READWRITE);
+
+        for (std::size_t i = 0; i < cmds.size(); i += batch_size) {
+            auto last = std::min(cmds.size(), i + batch_size);
+
+            sql::Transaction transaction(session);
+            for (std::size_t j = i; j < last; ++j) {
+                sql::insert(session, cmds[j].first, cmds[j].second);
+            }
+            transaction.commit();
         }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
     }
 
-    sql::delete_duplicate(db);
+    auto elapsed = seconds(std::chrono::steady_clock::now() - start).count();
+    auto rate = elapsed > 0 ? static_cast<double>(num_entries) / elapsed : 0.0;
 
-    sqlite3_close(db);
+    std::cerr << "loaded " << cmds.size() << " commands from " << num_entries
+              << " entries in " << elapsed << "s ("
+              << static_cast<std::size_t>(rate) << " entries/s)\n";
 
     return 0;
 }
@@ -0,0 +1,94 @@
+#include "zhist.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+
+#include <sqlite3.h>
+
+namespace fs = std::filesystem;
+
+using ms = std::chrono::milliseconds;
+using seconds = std::chrono::duration<double>;
+using std::chrono::duration_cast;
+
+namespace {
+
+// pages merged or truncated per transaction, 8 MiB with the default page
+// size
+constexpr int vacuum_pages = 2048;
+
+}  // namespace
+
+namespace command {
+
+int prune(const fs::path& db_path, const Retention& retention,
+          int batch_size) {
+    batch_size = std::max(batch_size, 1);
+
+    auto start = std::chrono::steady_clock::now();
+
+    sql::PruneCounts counts = {.num_events = 0, .num_commands = 0};
+    uintmax_t old_size = 0;
+    uintmax_t new_size = 0;
+
+    try {
+        old_size = fs::file_size(db_path);
+
+        sql::Session session(db_path, SQLITE_OPEN_READWRITE);
+
+        if (!sql::has_incremental_vacuum(session)) {
+            std::cerr << "rebuilding database once to free pages as it "
+                         "shrinks\n";
+            sql::enable_incremental_vacuum(session);
+        }
+
+        auto now = duration_cast<ms>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                       .count();
+        auto num_expired = sql::mark_expired(session, retention, now);
+
+        // short transactions, so that adds are never held up for long
+        for (std::size_t i = 0; i < num_expired; i += batch_size) {
+            sql::Transaction transaction(session);
+            auto batch = sql::prune(session, batch_size);
+            transaction.commit();
+
+            counts.num_events += batch.num_events;
+            counts.num_commands += batch.num_commands;
+        }
+
+        // the cache may point at deleted rows whose ids get reused
+        if (counts.num_events > 0) {
+            RecentCache cache(db_path);
+            cache.clear();
+        }
+
+        if (counts.num_commands > 0) {
+            while (sql::merge_search_index(session, vacuum_pages)) {
+            }
+        }
+        while (sql::incremental_vacuum(session, vacuum_pages)) {
+        }
+        sql::checkpoint(session);
+
+        new_size = fs::file_size(db_path);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    auto elapsed = seconds(std::chrono::steady_clock::now() - start).count();
+
+    std::cerr << "pruned " << counts.num_events << " events and "
+              << counts.num_commands << " commands in " << elapsed
+              << "s, database went from " << old_size << " to " << new_size
+              << " bytes\n";
+
+    return 0;
+}
+
+}  // namespace command
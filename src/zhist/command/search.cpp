@@ -0,0 +1,39 @@
+#include "zhist.hpp"
+
+#include <unistd.h>
+
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include <sqlite3.h>
+
+namespace fs = std::filesystem;
+
+namespace command {
+
+int search(const fs::path& db_path, const std::string& query, int limit,
+           ViewMode view_mode) {
+    Printer printer(STDOUT_FILENO, view_mode);
+
+    try {
+        auto cwd_path = fs::current_path();
+
+        // the journal is folded in first, so recent adds are found too
+        journal::compact_pending(db_path);
+
+        sql::Session session(db_path, SQLITE_OPEN_READONLY);
+
+        sql::search(session, query, cwd_path, limit,
+                    [&](std::string_view cmd) { printer.print(cmd); });
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
+
+}  // namespace command
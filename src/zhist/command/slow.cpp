@@ -0,0 +1,80 @@
+#include "zhist.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <sqlite3.h>
+
+namespace fs = std::filesystem;
+
+using ms = std::chrono::milliseconds;
+
+namespace {
+
+// 850ms, 3.2s or 4m05s
+std::string format_duration(double duration_ms) {
+    std::ostringstream out;
+    if (duration_ms < 1000) {
+        out << static_cast<int64_t>(duration_ms + 0.5) << "ms";
+    } else if (duration_ms < 60 * 1000) {
+        out << std::fixed << std::setprecision(1) << duration_ms / 1000 << 's';
+    } else {
+        auto seconds = static_cast<int64_t>(duration_ms / 1000 + 0.5);
+        out << seconds / 60 << 'm' << std::setw(2) << std::setfill('0')
+            << seconds % 60 << 's';
+    }
+    return out.str();
+}
+
+std::string format_change(double before, double after) {
+    return format_duration(before) + " -> " + format_duration(after);
+}
+
+}  // namespace
+
+namespace command {
+
+int slow(const fs::path& db_path, int limit, int num_days, int baseline_days,
+         int min_runs) {
+    try {
+        // the journal is folded in first, so the latest runs are compared
+        // unless the database is busy or read-only
+        journal::compact_pending(db_path);
+
+        sql::Session session(db_path, SQLITE_OPEN_READONLY);
+
+        auto now = std::chrono::system_clock::now();
+        auto time = duration_cast<ms>(now.time_since_epoch()).count();
+
+        auto cmds = sql::select_slow(session, time, num_days, baseline_days,
+                                     min_runs, std::max(limit, 0));
+
+        if (!cmds.empty()) {
+            std::cout << std::left << std::setw(22) << "p50" << std::setw(22)
+                      << "p95" << std::right << std::setw(6) << "runs"
+                      << "  command\n";
+        }
+        for (const auto& cmd : cmds) {
+            std::cout << std::left << std::setw(22)
+                      << format_change(cmd.baseline_p50, cmd.recent_p50)
+                      << std::setw(22)
+                      << format_change(cmd.baseline_p95, cmd.recent_p95)
+                      << std::right << std::setw(6) << cmd.recent_count << "  "
+                      << cmd.command << '\n';
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
+
+}  // namespace command
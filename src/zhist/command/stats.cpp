@@ -0,0 +1,226 @@
+#include "zhist.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <ctime>
+#include <exception>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <system_error>
+
+#include <nlohmann/json.hpp>
+#include <sqlite3.h>
+
+namespace fs = std::filesystem;
+
+using json = nlohmann::json;
+
+namespace {
+
+constexpr int64_t seconds_per_hour = 60 * 60;
+constexpr std::size_t bar_width = 40;
+
+uintmax_t file_size(const fs::path& db_path, const char* suffix) {
+    auto path = db_path;
+    path += suffix;
+    std::error_code ec;
+    auto size = fs::file_size(path, ec);
+    return ec ? 0 : size;
+}
+
+// activity is kept per UTC hour and shown in local time
+struct Activity {
+    std::array<int64_t, 24> hours{};
+    // runs per local date, YYYY-MM-DD, of the last days
+    std::map<std::string, int64_t> days;
+};
+
+Activity get_activity(const sql::Report& report, int num_days) {
+    Activity activity;
+
+    auto now = std::time(nullptr);
+    auto first_day = now - static_cast<std::time_t>(num_days) * 24 *
+                               seconds_per_hour;
+
+    for (auto [hour, count] : report.activity) {
+        auto t = static_cast<std::time_t>(hour * seconds_per_hour);
+        std::tm tm = {};
+        localtime_r(&t, &tm);
+
+        activity.hours.at(tm.tm_hour) += count;
+
+        if (t >= first_day) {
+            std::array<char, 16> date{};
+            std::strftime(date.data(), date.size(), "%Y-%m-%d", &tm);
+            activity.days[date.data()] += count;
+        }
+    }
+
+    return activity;
+}
+
+double rate(const sql::Report::Failures& failures) {
+    return failures.count > 0 ? static_cast<double>(failures.failure_count) /
+                                    static_cast<double>(failures.count)
+                              : 0.0;
+}
+
+// the count and a bar scaled to the largest count
+void print_bar(int64_t count, int64_t max_count) {
+    auto width = max_count > 0 ? static_cast<std::size_t>(
+                                     count * bar_width / max_count)
+                               : 0;
+    std::cout << std::setw(10) << count;
+    if (width > 0) {
+        std::cout << "  " << std::string(width, '#');
+    }
+    std::cout << '\n';
+}
+
+void print_json(const fs::path& db_path, const sql::Report& report,
+                const Activity& activity, const RecentCache& cache) {
+    auto counts = [](const std::vector<sql::Report::Count>& counts,
+                     const char* key) {
+        auto array = json::array();
+        for (const auto& count : counts) {
+            array.push_back({{key, count.text}, {"count", count.count}});
+        }
+        return array;
+    };
+
+    auto failing = json::array();
+    for (const auto& failures : report.failing_commands) {
+        failing.push_back({
+            {"command", failures.command},
+            {"failures", failures.failure_count},
+            {"runs", failures.count},
+            {"rate", rate(failures)},
+        });
+    }
+
+    auto days = json::array();
+    for (const auto& [date, count] : activity.days) {
+        days.push_back({{"date", date}, {"count", count}});
+    }
+
+    json result = {
+        {"database",
+         {
+             {"path", db_path.string()},
+             {"size", file_size(db_path, "")},
+             {"wal_size", file_size(db_path, "-wal")},
+             {"journal_size", file_size(db_path, ".journal")},
+             {"page_size", report.page_size},
+             {"page_count", report.page_count},
+             {"freelist_count", report.freelist_count},
+         }},
+        {"commands", report.num_commands},
+        {"directories", report.num_directories},
+        {"runs", report.num_runs},
+        {"cache", {{"hits", cache.hits()}, {"misses", cache.misses()}}},
+        {"top_commands", counts(report.top_commands, "command")},
+        {"top_directories", counts(report.top_directories, "directory")},
+        {"failing_commands", failing},
+        {"hours", activity.hours},
+        {"days", days},
+    };
+
+    std::cout << result.dump(2) << '\n';
+}
+
+void print_counts(const char* title,
+                  const std::vector<sql::Report::Count>& counts) {
+    std::cout << '\n' << title << '\n';
+    for (const auto& count : counts) {
+        std::cout << std::setw(10) << count.count << "  " << count.text
+                  << '\n';
+    }
+}
+
+void print_text(const fs::path& db_path, const sql::Report& report,
+                const Activity& activity, const RecentCache& cache) {
+    auto lookups = cache.hits() + cache.misses();
+
+    std::cout << "database     " << db_path.string() << '\n'
+              << "size         " << file_size(db_path, "") << " bytes, "
+              << report.freelist_count << " of " << report.page_count
+              << " pages free, wal " << file_size(db_path, "-wal")
+              << " bytes, journal " << file_size(db_path, ".journal")
+              << " bytes\n"
+              << "history      " << report.num_runs << " runs of "
+              << report.num_commands << " commands in "
+              << report.num_directories << " directories\n"
+              << "recent cache " << cache.hits() << " hits, "
+              << cache.misses() << " misses";
+    if (lookups > 0) {
+        std::cout << " (" << std::fixed << std::setprecision(1)
+                  << 100.0 * static_cast<double>(cache.hits()) /
+                         static_cast<double>(lookups)
+                  << "% hit)";
+    }
+    std::cout << '\n';
+
+    print_counts("top commands", report.top_commands);
+    print_counts("top directories", report.top_directories);
+
+    std::cout << "\nfailing commands\n";
+    for (const auto& failures : report.failing_commands) {
+        std::cout << std::setw(10) << failures.failure_count << "  "
+                  << std::setw(5) << std::fixed << std::setprecision(1)
+                  << 100.0 * rate(failures) << "%  " << failures.command
+                  << '\n';
+    }
+
+    std::cout << "\nruns by hour\n";
+    auto max_hour = *std::ranges::max_element(activity.hours);
+    for (std::size_t hour = 0; hour < activity.hours.size(); ++hour) {
+        std::cout << "  " << std::setw(2) << std::setfill('0') << hour
+                  << std::setfill(' ');
+        print_bar(activity.hours[hour], max_hour);
+    }
+
+    std::cout << "\nruns by day\n";
+    int64_t max_day = 0;
+    for (const auto& [_, count] : activity.days) {
+        max_day = std::max(max_day, count);
+    }
+    for (const auto& [date, count] : activity.days) {
+        std::cout << "  " << date;
+        print_bar(count, max_day);
+    }
+}
+
+}  // namespace
+
+namespace command {
+
+int stats(const fs::path& db_path, int limit, int num_days, bool is_json) {
+    try {
+        // the journal is folded in first, so the counts include every add
+        // unless the database is busy or read-only
+        journal::compact_pending(db_path);
+
+        sql::Session session(db_path, SQLITE_OPEN_READONLY);
+        RecentCache cache(db_path);
+
+        auto report = sql::report(session, std::max(limit, 0));
+        auto activity = get_activity(report, std::max(num_days, 0));
+
+        if (is_json) {
+            print_json(db_path, report, activity, cache);
+        } else {
+            print_text(db_path, report, activity, cache);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
+
+}  // namespace command
@@ -1,8 +1,13 @@
 #include "zhist.hpp"
 
+#include <glob.h>
+
+#include <algorithm>
+#include <cstdint>
 #include <cstdlib>
 #include <filesystem>
 #include <string>
+#include <vector>
 
 #include <toml++/toml.hpp>
 
@@ -18,6 +23,66 @@ std::string get_env(const std::string& name) {
     return env;
 }
 
+// only databases that exist are matched, a pattern matching nothing adds
+// none
+void expand(const std::string& pattern, std::vector<fs::path>& paths) {
+    glob_t matches = {};
+    if (glob(pattern.c_str(), GLOB_TILDE | GLOB_BRACE, nullptr, &matches) ==
+        0) {
+        for (std::size_t i = 0; i < matches.gl_pathc; ++i) {
+            fs::path path = matches.gl_pathv[i];
+            if (std::ranges::find(paths, path) == paths.end()) {
+                paths.push_back(std::move(path));
+            }
+        }
+    }
+    globfree(&matches);
+}
+
+// merge_db_paths is either one glob or an array of them. the paths start
+// with db_path, so it is never matched twice
+std::vector<fs::path> get_db_paths(const fs::path& db_path,
+                                   const toml::node_view<toml::node>& node) {
+    std::vector<fs::path> paths = {db_path};
+    if (auto path = node.value<std::string>()) {
+        expand(*path, paths);
+    } else if (const auto* array = node.as_array()) {
+        for (const auto& element : *array) {
+            if (auto path = element.value<std::string>()) {
+                expand(*path, paths);
+            }
+        }
+    }
+    return paths;
+}
+
+Retention get_retention(const toml::node_view<toml::node>& node) {
+    return {
+        .max_rows = node["max_rows"].value<int64_t>(),
+        .max_age_days = node["max_age_days"].value<int64_t>(),
+        .max_per_command = node["max_per_command"].value<int64_t>(),
+    };
+}
+
+std::vector<std::string> get_strings(const toml::node_view<toml::node>& node) {
+    std::vector<std::string> strings;
+    if (const auto* array = node.as_array()) {
+        for (const auto& element : *array) {
+            if (auto string = element.value<std::string>()) {
+                strings.push_back(std::move(*string));
+            }
+        }
+    }
+    return strings;
+}
+
+Redaction get_redaction(const toml::node_view<toml::node>& node) {
+    return {
+        .prefixes = get_strings(node["prefixes"]),
+        .patterns = get_strings(node["patterns"]),
+    };
+}
+
 }  // namespace
 
 Config get_config() {
@@ -35,14 +100,23 @@ Config get_config() {
         auto db_path = config_file["db_path"].value<std::string>();
         auto recent_num = config_file["recent_num"].value<int>();
 
+        auto local_db_path = db_path ? fs::path(*db_path) : default_db_path;
+
         return {
-            .db_path = db_path ? fs::path(*db_path) : default_db_path,
+            .db_path = local_db_path,
+            .db_paths =
+                get_db_paths(local_db_path, config_file["merge_db_paths"]),
             .recent_num = recent_num ? *recent_num : default_recent_num,
+            .retention = get_retention(config_file["retention"]),
+            .redaction = get_redaction(config_file["redaction"]),
         };
     } catch (std::exception& _) {
         return {
             .db_path = default_db_path,
+            .db_paths = {default_db_path},
             .recent_num = default_recent_num,
+            .retention = {},
+            .redaction = {},
         };
     }
 }
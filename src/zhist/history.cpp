@@ -0,0 +1,141 @@
+#include "zhist.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// zsh escapes bytes that collide with its tokens as Meta followed by the
+// byte xor 32
+constexpr char meta = '\x83';
+constexpr char meta_xor = 32;
+
+constexpr int64_t ms_per_second = 1000;
+
+bool consume(std::string_view& s, char c) {
+    if (s.empty() || s.front() != c) {
+        return false;
+    }
+    s.remove_prefix(1);
+    return true;
+}
+
+bool consume_number(std::string_view& s, int64_t& value) {
+    const auto* first = s.data();
+    const auto* last = first + s.size();
+    auto [ptr, ec] = std::from_chars(first, last, value);
+    if (ec != std::errc() || ptr == first) {
+        return false;
+    }
+    s.remove_prefix(ptr - first);
+    return true;
+}
+
+// parses ": <start>:<elapsed>;" and strips it from the line
+bool consume_extended_header(std::string_view& line, HistoryEntry& entry) {
+    auto s = line;
+    int64_t start = 0;
+    int64_t elapsed = 0;
+
+    if (!consume(s, ':') || !consume(s, ' ') || !consume_number(s, start) ||
+        !consume(s, ':') || !consume_number(s, elapsed) || !consume(s, ';')) {
+        return false;
+    }
+
+    entry.time = start * ms_per_second;
+    entry.duration = elapsed * ms_per_second;
+    line = s;
+    return true;
+}
+
+void unmetafy(std::string& s) {
+    std::size_t out = 0;
+    for (std::size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == meta && i + 1 < s.size()) {
+            s[out++] = static_cast<char>(s[++i] ^ meta_xor);
+        } else {
+            s[out++] = s[i];
+        }
+    }
+    s.resize(out);
+}
+
+}  // namespace
+
+HistoryFile::HistoryFile(const fs::path& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("can't open file");
+    }
+
+    struct stat st = {};
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("can't open file");
+    }
+
+    size_ = static_cast<std::size_t>(st.st_size);
+    if (size_ > 0) {
+        void* addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("can't map file");
+        }
+        madvise(addr, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(addr);
+    }
+
+    close(fd);
+}
+
+HistoryFile::~HistoryFile() {
+    if (data_ != nullptr) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+}
+
+void HistoryFile::for_each(const std::function<void(const HistoryEntry&)>& f) {
+    std::string_view buf(data_, size_);
+
+    auto next_line = [&buf] {
+        auto end = buf.find('\n');
+        auto line = buf.substr(0, end);
+        buf.remove_prefix(end == std::string_view::npos ? buf.size() : end + 1);
+        return line;
+    };
+
+    while (!buf.empty()) {
+        auto line = next_line();
+
+        HistoryEntry entry;
+        consume_extended_header(line, entry);
+
+        // a trailing backslash means the command continues on the next line
+        if (line.ends_with('\\') || line.find(meta) != std::string_view::npos) {
+            std::string cmd(line);
+            while (cmd.ends_with('\\') && !buf.empty()) {
+                cmd.back() = '\n';
+                cmd.append(next_line());
+            }
+            unmetafy(cmd);
+            entry.command = decoded_.emplace_back(std::move(cmd));
+        } else {
+            entry.command = line;
+        }
+
+        f(entry);
+    }
+}
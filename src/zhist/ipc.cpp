@@ -0,0 +1,365 @@
+#include "zhist.hpp"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// replies from a local daemon never take this long, so a slower one is
+// treated as absent and the caller falls back to the database
+constexpr int client_timeout_ms = 200;
+constexpr int stream_timeout_ms = 2000;
+
+constexpr std::size_t io_buffer_size = 1 << 16;
+
+constexpr char status_ok = 1;
+constexpr char status_rejected = 0;
+
+class Encoder {
+public:
+    template <typename T>
+    void put(T value) {
+        buf_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void put(std::string_view str) {
+        put(static_cast<uint32_t>(str.size()));
+        buf_.append(str);
+    }
+
+    [[nodiscard]] const std::string& str() const {
+        return buf_;
+    }
+
+private:
+    std::string buf_;
+};
+
+class Decoder {
+public:
+    explicit Decoder(std::string_view buf) : buf_(buf) {}
+
+    template <typename T>
+    bool get(T& value) {
+        if (buf_.size() < sizeof(value)) {
+            return false;
+        }
+        std::memcpy(&value, buf_.data(), sizeof(value));
+        buf_.remove_prefix(sizeof(value));
+        return true;
+    }
+
+    bool get(std::string& str) {
+        uint32_t size = 0;
+        if (!get(size) || buf_.size() < size) {
+            return false;
+        }
+        str.assign(buf_.substr(0, size));
+        buf_.remove_prefix(size);
+        return true;
+    }
+
+private:
+    std::string_view buf_;
+};
+
+bool write_all(int fd, const char* data, std::size_t size) {
+    while (size > 0) {
+        auto n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool read_all(int fd, char* data, std::size_t size) {
+    while (size > 0) {
+        auto n = recv(fd, data, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+std::string get_env(const char* name) {
+    const char* env = std::getenv(name);
+    return env != nullptr ? env : "";
+}
+
+// where the socket lives, the same places zprompt keeps its own
+fs::path runtime_dir() {
+    if (auto runtime_dir = get_env("XDG_RUNTIME_DIR"); !runtime_dir.empty()) {
+        return fs::path(runtime_dir) / "zhist";
+    }
+    if (auto cache_dir = get_env("XDG_CACHE_HOME"); !cache_dir.empty()) {
+        return fs::path(cache_dir) / "zhist";
+    }
+    return fs::path(get_env("HOME")) / ".cache" / "zhist";
+}
+
+// makes the directory unless it exists, and accepts it only when it is a
+// real directory of the user that nobody else can enter. another user
+// could otherwise put a socket there, or remove ours
+bool make_private_dir(const fs::path& path) {
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    mkdir(path.c_str(), 0700);
+
+    struct stat st = {};
+    if (lstat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != getuid()) {
+        return false;
+    }
+    return (st.st_mode & 077) == 0 || chmod(path.c_str(), 0700) == 0;
+}
+
+sockaddr_un make_address(const fs::path& path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+int connect_daemon() {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    timeval tv = {.tv_sec = 0, .tv_usec = client_timeout_ms * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    auto addr = make_address(ipc::socket_path());
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        !ipc::is_same_user(fd)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// sends a request and waits for the daemon to accept it
+int send_request(const std::string& payload) {
+    int fd = connect_daemon();
+    if (fd < 0) {
+        return -1;
+    }
+
+    std::string status;
+    if (!ipc::write_frame(fd, payload) || !ipc::read_frame(fd, status) ||
+        status.size() != 1 || status[0] != status_ok) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+}  // namespace
+
+namespace ipc {
+
+fs::path socket_path() {
+    return runtime_dir() / "zhist.sock";
+}
+
+int listen_socket() {
+    auto path = socket_path();
+    if (!make_private_dir(path.parent_path())) {
+        return -1;
+    }
+
+    // a socket file nobody answers on is left over from a dead daemon
+    if (int fd = connect_daemon(); fd >= 0) {
+        close(fd);
+        return -1;
+    }
+    unlink(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    constexpr int backlog = 64;
+
+    auto addr = make_address(path);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        listen(fd, backlog) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool is_same_user(int fd) {
+    ucred cred = {};
+    socklen_t size = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) == 0 &&
+           cred.uid == getuid();
+}
+
+bool FrameWriter::write(std::string_view payload) {
+    auto size = static_cast<uint32_t>(payload.size());
+    buf_.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    buf_.append(payload);
+    return buf_.size() < io_buffer_size || flush();
+}
+
+bool FrameWriter::flush() {
+    bool ok = write_all(fd_, buf_.data(), buf_.size());
+    buf_.clear();
+    return ok;
+}
+
+std::optional<std::string_view> FrameReader::read() {
+    uint32_t size = 0;
+    if (!fill(sizeof(size))) {
+        return std::nullopt;
+    }
+    std::memcpy(&size, buf_.data() + pos_, sizeof(size));
+    pos_ += sizeof(size);
+
+    if (!fill(size)) {
+        return std::nullopt;
+    }
+    auto payload = std::string_view(buf_).substr(pos_, size);
+    pos_ += size;
+    return payload;
+}
+
+// makes at least size unread bytes available in the buffer
+bool FrameReader::fill(std::size_t size) {
+    if (buf_.size() - pos_ >= size) {
+        return true;
+    }
+
+    buf_.erase(0, pos_);
+    pos_ = 0;
+
+    while (buf_.size() < size) {
+        auto filled = buf_.size();
+        buf_.resize(std::max(size, filled + io_buffer_size));
+        auto n = recv(fd_, buf_.data() + filled, buf_.size() - filled, 0);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+        } else if (n <= 0) {
+            buf_.resize(filled);
+            return false;
+        }
+        buf_.resize(filled + n);
+    }
+
+    return true;
+}
+
+bool write_frame(int fd, std::string_view payload) {
+    auto size = static_cast<uint32_t>(payload.size());
+    return write_all(fd, reinterpret_cast<const char*>(&size), sizeof(size)) &&
+           write_all(fd, payload.data(), payload.size());
+}
+
+bool read_frame(int fd, std::string& payload) {
+    constexpr uint32_t max_frame_size = 1 << 24;
+
+    uint32_t size = 0;
+    if (!read_all(fd, reinterpret_cast<char*>(&size), sizeof(size)) ||
+        size > max_frame_size) {
+        return false;
+    }
+    payload.resize(size);
+    return read_all(fd, payload.data(), size);
+}
+
+bool write_status(int fd, bool ok) {
+    char status = ok ? status_ok : status_rejected;
+    return write_frame(fd, std::string_view(&status, 1));
+}
+
+std::optional<ListRequest> read_request(int fd) {
+    std::string payload;
+    if (!read_frame(fd, payload)) {
+        return std::nullopt;
+    }
+
+    Decoder dec(payload);
+
+    RequestType type{};
+    ListRequest req;
+    if (dec.get(type) && type == RequestType::List && dec.get(req.db_path) &&
+        dec.get(req.filter_mode) && dec.get(req.recent_num) &&
+        dec.get(req.cwd)) {
+        return req;
+    }
+
+    return std::nullopt;
+}
+
+bool list(const fs::path& db_path, int recent_num, FilterMode filter_mode,
+          const fs::path& cwd_path, const CommandVisitor& f) {
+    Encoder enc;
+    enc.put(RequestType::List);
+    enc.put(std::string_view(db_path.native()));
+    enc.put(filter_mode);
+    enc.put(static_cast<int32_t>(recent_num));
+    enc.put(std::string_view(cwd_path.native()));
+
+    int fd = send_request(enc.str());
+    if (fd < 0) {
+        return false;
+    }
+
+    // once accepted, the list may take longer than the request, but a
+    // daemon that goes quiet for this long is taken to be stuck
+    timeval tv = {.tv_sec = stream_timeout_ms / 1000,
+                  .tv_usec = stream_timeout_ms % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // an empty frame marks the end of the list, without it the list was
+    // cut short
+    bool is_complete = false;
+    FrameReader reader(fd);
+    while (auto cmd = reader.read()) {
+        if (cmd->empty()) {
+            is_complete = true;
+            break;
+        }
+        f(*cmd);
+    }
+
+    close(fd);
+    return is_complete;
+}
+
+}  // namespace ipc
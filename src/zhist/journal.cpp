@@ -0,0 +1,368 @@
+#include "zhist.hpp"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <optional>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include <sqlite3.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr uint32_t record_magic = 0x324a485a;     // "ZHJ2"
+constexpr uint32_t record_magic_v1 = 0x314a485a;  // "ZHJ1"
+
+// each record is this header followed by the directory and the command
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t command_size;
+    uint32_t directory_size;
+    int32_t code;
+    int64_t time;
+    // negative when the shell did not measure it
+    int64_t duration;
+};
+
+// records left by a zhist that did not record durations yet
+struct RecordHeaderV1 {
+    uint32_t magic;
+    uint32_t command_size;
+    uint32_t directory_size;
+    int32_t code;
+    int64_t time;
+};
+
+// appenders that raced with a compaction retry on the new journal
+constexpr int max_append_attempts = 4;
+
+fs::path with_suffix(const fs::path& db_path, const char* suffix) {
+    auto path = db_path;
+    path += suffix;
+    return path;
+}
+
+fs::path journal_path(const fs::path& db_path) {
+    return with_suffix(db_path, ".journal");
+}
+
+// the journal being folded into the database, renamed out of the way of
+// new appends
+fs::path compacting_path(const fs::path& db_path) {
+    return with_suffix(db_path, ".journal.compacting");
+}
+
+fs::path lock_path(const fs::path& db_path) {
+    return with_suffix(db_path, ".journal.lock");
+}
+
+// closes the descriptor, and with it any flock, when it goes out of scope
+class FileDescriptor {
+public:
+    explicit FileDescriptor(int fd) : fd_(fd) {}
+    ~FileDescriptor() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+    FileDescriptor(FileDescriptor&&) = delete;
+    FileDescriptor& operator=(FileDescriptor&&) = delete;
+
+    [[nodiscard]] int get() const {
+        return fd_;
+    }
+
+private:
+    int fd_;
+};
+
+bool read_file(int fd, std::string& data) {
+    struct stat st = {};
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+
+    data.resize(static_cast<std::size_t>(st.st_size));
+    std::size_t done = 0;
+    while (done < data.size()) {
+        auto n = pread(fd, data.data() + done, data.size() - done,
+                       static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    data.resize(done);
+    return true;
+}
+
+// a record cut short by a crash ends the journal
+void parse(std::string_view data, std::vector<journal::Entry>& entries) {
+    while (data.size() >= sizeof(uint32_t)) {
+        RecordHeader header{};
+        std::memcpy(&header.magic, data.data(), sizeof(header.magic));
+
+        if (header.magic == record_magic_v1 &&
+            data.size() >= sizeof(RecordHeaderV1)) {
+            RecordHeaderV1 header_v1{};
+            std::memcpy(&header_v1, data.data(), sizeof(header_v1));
+            data.remove_prefix(sizeof(header_v1));
+            header = {
+                .magic = header_v1.magic,
+                .command_size = header_v1.command_size,
+                .directory_size = header_v1.directory_size,
+                .code = header_v1.code,
+                .time = header_v1.time,
+                .duration = -1,
+            };
+        } else if (header.magic == record_magic &&
+                   data.size() >= sizeof(RecordHeader)) {
+            std::memcpy(&header, data.data(), sizeof(header));
+            data.remove_prefix(sizeof(header));
+        } else {
+            return;
+        }
+
+        auto size = static_cast<std::size_t>(header.directory_size) +
+                    header.command_size;
+        if (data.size() < size) {
+            return;
+        }
+
+        entries.push_back({
+            .command = std::string(
+                data.substr(header.directory_size, header.command_size)),
+            .directory = std::string(data.substr(0, header.directory_size)),
+            .code = header.code,
+            .time = header.time,
+            .duration = header.duration >= 0
+                            ? std::optional<int64_t>(header.duration)
+                            : std::nullopt,
+        });
+        data.remove_prefix(size);
+    }
+}
+
+void read_path(const fs::path& path, std::vector<journal::Entry>& entries) {
+    FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    std::string data;
+    if (fd.get() >= 0 && read_file(fd.get(), data)) {
+        parse(data, entries);
+    }
+}
+
+bool is_nonempty(const fs::path& path) {
+    struct stat st = {};
+    return stat(path.c_str(), &st) == 0 && st.st_size > 0;
+}
+
+}  // namespace
+
+namespace journal {
+
+// the record goes out in one write(2) with O_APPEND, so concurrent shells
+// never interleave. the shared lock only keeps a compaction from reading
+// the file while the write is in flight
+bool append(const fs::path& db_path, std::string_view cmd,
+            std::string_view dir, int code, int64_t time,
+            std::optional<int64_t> duration) {
+    RecordHeader header = {
+        .magic = record_magic,
+        .command_size = static_cast<uint32_t>(cmd.size()),
+        .directory_size = static_cast<uint32_t>(dir.size()),
+        .code = code,
+        .time = time,
+        .duration = duration ? std::max<int64_t>(*duration, 0) : -1,
+    };
+
+    std::string record;
+    record.reserve(sizeof(header) + dir.size() + cmd.size());
+    record.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    record.append(dir);
+    record.append(cmd);
+
+    auto path = journal_path(db_path);
+
+    for (int attempt = 0; attempt < max_append_attempts; ++attempt) {
+        constexpr int flags = O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC;
+
+        FileDescriptor fd(open(path.c_str(), flags, 0600));
+        if (fd.get() < 0 || flock(fd.get(), LOCK_SH) != 0) {
+            return false;
+        }
+
+        // a compaction may have renamed the file after it was opened
+        struct stat fd_st = {};
+        struct stat path_st = {};
+        if (fstat(fd.get(), &fd_st) != 0 ||
+            stat(path.c_str(), &path_st) != 0 ||
+            fd_st.st_ino != path_st.st_ino) {
+            continue;
+        }
+
+        auto n = write(fd.get(), record.data(), record.size());
+        return n == static_cast<ssize_t>(record.size());
+    }
+
+    return false;
+}
+
+bool pending(const fs::path& db_path) {
+    return is_nonempty(journal_path(db_path)) ||
+           is_nonempty(compacting_path(db_path));
+}
+
+std::vector<Entry> read(const fs::path& db_path) {
+    std::vector<Entry> entries;
+    read_path(compacting_path(db_path), entries);
+    read_path(journal_path(db_path), entries);
+    return entries;
+}
+
+std::optional<std::size_t> compact(sql::Session& session, RecentCache& cache,
+                                   const fs::path& db_path) {
+    FileDescriptor lock_fd(open(lock_path(db_path).c_str(),
+                                O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+    if (lock_fd.get() < 0 || flock(lock_fd.get(), LOCK_EX | LOCK_NB) != 0) {
+        return std::nullopt;
+    }
+
+    // a journal left by a failed compaction is folded in first, and the
+    // current one waits for the next run
+    auto path = compacting_path(db_path);
+    if (!fs::exists(path) &&
+        rename(journal_path(db_path).c_str(), path.c_str()) != 0) {
+        return 0;
+    }
+
+    FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.get() < 0 || flock(fd.get(), LOCK_EX) != 0) {
+        return std::nullopt;
+    }
+
+    std::string data;
+    if (!read_file(fd.get(), data)) {
+        return std::nullopt;
+    }
+
+    std::vector<Entry> entries;
+    parse(data, entries);
+
+    if (!entries.empty()) {
+        sql::Transaction transaction(session);
+        for (const auto& entry : entries) {
+            sql::insert(session, cache, entry.command, entry.directory,
+                        entry.code, entry.time, entry.duration);
+        }
+        transaction.commit();
+    }
+
+    unlink(path.c_str());
+
+    return entries.size();
+}
+
+void compact_pending(const fs::path& db_path) {
+    if (!pending(db_path) || access(db_path.c_str(), W_OK) != 0) {
+        return;
+    }
+
+    // the read goes on without the journal when it can't be folded in,
+    // and a broken database shows up there
+    try {
+        sql::Session session(db_path, SQLITE_OPEN_READWRITE);
+        sqlite3_busy_handler(session.get(), nullptr, nullptr);
+
+        RecentCache cache(db_path);
+        compact(session, cache, db_path);
+    } catch (const std::exception&) {
+    }
+}
+
+bool matches(const Entry& entry, FilterMode filter_mode,
+             const fs::path& cwd_path) {
+    switch (filter_mode) {
+        case FilterMode::Recent:
+            return entry.code == 0;
+        case FilterMode::CurrentPath:
+            return entry.code == 0 && entry.directory == cwd_path.native();
+        case FilterMode::Subtree: {
+            const auto& dir = cwd_path.native();
+            std::string_view entry_dir = entry.directory;
+            return entry.code == 0 && entry_dir.starts_with(dir) &&
+                   (entry_dir.size() == dir.size() || dir.ends_with('/') ||
+                    entry_dir[dir.size()] == '/');
+        }
+        default:
+            return true;
+    }
+}
+
+// journal entries are newer than anything in the database, so they are
+// listed first and their commands skipped when the database lists them.
+// for frecency and subtree this ranks them above everything, which is
+// close enough for the few entries that can be left over between
+// compactions
+void select(sql::Session& session, const std::vector<Entry>& entries,
+            FilterMode filter_mode, int recent_num, const fs::path& cwd_path,
+            const CommandVisitor& f) {
+    // newest first, without duplicates
+    std::vector<std::string_view> fresh;
+    std::unordered_set<std::string_view> seen;
+    for (const auto& entry : entries | std::views::reverse) {
+        if (matches(entry, filter_mode, cwd_path) &&
+            seen.insert(entry.command).second) {
+            fresh.push_back(entry.command);
+        }
+    }
+
+    if (filter_mode == FilterMode::Recent) {
+        // listed oldest first, so the newest commands end the list
+        std::vector<std::string> cmds;
+        sql::select(session, filter_mode, recent_num, cwd_path,
+                    [&](std::string_view cmd) {
+                        if (!seen.contains(cmd)) {
+                            cmds.emplace_back(cmd);
+                        }
+                    });
+        cmds.insert(cmds.end(), fresh.rbegin(), fresh.rend());
+
+        auto skip = cmds.size() - std::min<std::size_t>(
+                                      cmds.size(), std::max(recent_num, 0));
+        std::for_each(cmds.begin() + static_cast<std::ptrdiff_t>(skip),
+                      cmds.end(), [&](const std::string& cmd) { f(cmd); });
+        return;
+    }
+
+    for (auto cmd : fresh) {
+        f(cmd);
+    }
+    sql::select(session, filter_mode, recent_num, cwd_path,
+                [&](std::string_view cmd) {
+                    if (!seen.contains(cmd)) {
+                        f(cmd);
+                    }
+                });
+}
+
+}  // namespace journal
@@ -0,0 +1,288 @@
+#include "zhist.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <sqlite3.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// rows are handed between threads in chunks, and a reader stops once it
+// is this many chunks ahead of the merge
+constexpr std::size_t chunk_size = 512;
+constexpr std::size_t max_chunks = 4;
+
+struct Row {
+    std::string command;
+    double rank;
+};
+
+using Chunk = std::vector<Row>;
+
+// a bounded queue of chunks from one reader to the merge
+class Channel {
+public:
+    // returns false once the merge has gone away
+    bool push(Chunk&& chunk) {
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock,
+                 [this] { return cancelled_ || chunks_.size() < max_chunks; });
+        if (cancelled_) {
+            return false;
+        }
+        chunks_.push_back(std::move(chunk));
+        cv_.notify_all();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard lock(mutex_);
+        closed_ = true;
+        cv_.notify_all();
+    }
+
+    void cancel() {
+        std::lock_guard lock(mutex_);
+        cancelled_ = true;
+        cv_.notify_all();
+    }
+
+    std::optional<Chunk> pop() {
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, [this] { return closed_ || !chunks_.empty(); });
+        if (chunks_.empty()) {
+            return std::nullopt;
+        }
+        auto chunk = std::move(chunks_.front());
+        chunks_.pop_front();
+        cv_.notify_all();
+        return chunk;
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Chunk> chunks_;
+    bool closed_ = false;
+    bool cancelled_ = false;
+};
+
+// the rows of one channel, one at a time
+class Cursor {
+public:
+    explicit Cursor(Channel& channel) : channel_(channel) {
+        fill();
+    }
+
+    [[nodiscard]] Row* peek() {
+        return pos_ < chunk_.size() ? &chunk_[pos_] : nullptr;
+    }
+
+    void next() {
+        if (++pos_ >= chunk_.size()) {
+            fill();
+        }
+    }
+
+private:
+    void fill() {
+        pos_ = 0;
+        chunk_.clear();
+        while (auto chunk = channel_.pop()) {
+            if (!chunk->empty()) {
+                chunk_ = std::move(*chunk);
+                return;
+            }
+        }
+    }
+
+    Channel& channel_;
+    Chunk chunk_;
+    std::size_t pos_ = 0;
+};
+
+void read_database(const fs::path& db_path, FilterMode filter_mode,
+                   int recent_num, const fs::path& cwd_path,
+                   Channel& channel) {
+    try {
+        sql::Session session(db_path, SQLITE_OPEN_READONLY);
+
+        Chunk chunk;
+        bool open = true;
+        sql::select(session, filter_mode, recent_num, cwd_path,
+                    [&](std::string_view cmd, double rank) {
+                        if (!open) {
+                            return;
+                        }
+                        chunk.push_back({.command = std::string(cmd),
+                                         .rank = rank});
+                        if (chunk.size() >= chunk_size) {
+                            open = channel.push(std::move(chunk));
+                            chunk = Chunk();
+                        }
+                    });
+        if (open && !chunk.empty()) {
+            channel.push(std::move(chunk));
+        }
+    } catch (const std::exception& e) {
+        // a database that can't be read leaves the others to be listed
+        static std::mutex cerr_mutex;
+        std::lock_guard lock(cerr_mutex);
+        std::cerr << db_path.string() << ": " << e.what() << '\n';
+    }
+
+    channel.close();
+}
+
+// the journal entries the mode shows, newest first and ranked like the
+// database rows. for frecency and subtree they come before everything
+Chunk journal_rows(const std::vector<journal::Entry>& entries,
+                   FilterMode filter_mode, const fs::path& cwd_path) {
+    Chunk rows;
+    std::unordered_set<std::string_view> seen;
+    for (const auto& entry : entries | std::views::reverse) {
+        if (!journal::matches(entry, filter_mode, cwd_path) ||
+            !seen.insert(entry.command).second) {
+            continue;
+        }
+        auto rank = filter_mode == FilterMode::Frecency ||
+                            filter_mode == FilterMode::Subtree
+                        ? std::numeric_limits<double>::infinity()
+                        : static_cast<double>(entry.time);
+        rows.push_back({.command = entry.command, .rank = rank});
+    }
+    return rows;
+}
+
+// recent lists the newest commands oldest first, so the whole list has to
+// be known before the first one is printed
+void merge_recent(std::vector<Cursor>& cursors, int recent_num,
+                  const CommandVisitor& f) {
+    Chunk rows;
+    for (auto& cursor : cursors) {
+        for (const auto* row = cursor.peek(); row != nullptr;
+             cursor.next(), row = cursor.peek()) {
+            rows.push_back(*row);
+        }
+    }
+    std::ranges::stable_sort(rows, std::greater<>(), &Row::rank);
+
+    std::vector<std::string_view> cmds;
+    std::unordered_set<std::string_view> seen;
+    for (const auto& row : rows) {
+        if (cmds.size() >= static_cast<std::size_t>(std::max(recent_num, 0))) {
+            break;
+        }
+        if (seen.insert(row.command).second) {
+            cmds.push_back(row.command);
+        }
+    }
+
+    for (auto cmd : cmds | std::views::reverse) {
+        f(cmd);
+    }
+}
+
+// a k-way merge on the ranks, printing each command the first time it
+// comes up
+void merge_ranked(std::vector<Cursor>& cursors, const CommandVisitor& f) {
+    auto lower = [&](std::size_t a, std::size_t b) {
+        return cursors[a].peek()->rank < cursors[b].peek()->rank;
+    };
+    std::priority_queue<std::size_t, std::vector<std::size_t>, decltype(lower)>
+        heads(lower);
+    for (std::size_t i = 0; i < cursors.size(); ++i) {
+        if (cursors[i].peek() != nullptr) {
+            heads.push(i);
+        }
+    }
+
+    std::unordered_set<std::string> seen;
+    while (!heads.empty()) {
+        auto i = heads.top();
+        heads.pop();
+
+        auto& cmd = cursors[i].peek()->command;
+        auto [it, inserted] = seen.insert(std::move(cmd));
+        if (inserted) {
+            f(*it);
+        }
+
+        cursors[i].next();
+        if (cursors[i].peek() != nullptr) {
+            heads.push(i);
+        }
+    }
+}
+
+}  // namespace
+
+namespace merge {
+
+void select(const std::vector<fs::path>& db_paths,
+            const std::vector<journal::Entry>& entries, FilterMode filter_mode,
+            int recent_num, const fs::path& cwd_path, const CommandVisitor& f) {
+    // the journal is one more, already complete, stream
+    std::vector<std::unique_ptr<Channel>> channels;
+    auto rows = journal_rows(entries, filter_mode, cwd_path);
+    if (!rows.empty()) {
+        auto& channel = channels.emplace_back(std::make_unique<Channel>());
+        channel->push(std::move(rows));
+        channel->close();
+    }
+
+    std::vector<std::thread> readers;
+    for (const auto& db_path : db_paths) {
+        auto& channel = channels.emplace_back(std::make_unique<Channel>());
+        readers.emplace_back(read_database, std::cref(db_path), filter_mode,
+                             recent_num, std::cref(cwd_path),
+                             std::ref(*channel));
+    }
+
+    try {
+        std::vector<Cursor> cursors;
+        cursors.reserve(channels.size());
+        for (auto& channel : channels) {
+            cursors.emplace_back(*channel);
+        }
+
+        if (filter_mode == FilterMode::Recent) {
+            merge_recent(cursors, recent_num, f);
+        } else {
+            merge_ranked(cursors, f);
+        }
+    } catch (...) {
+        for (auto& channel : channels) {
+            channel->cancel();
+        }
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        throw;
+    }
+
+    for (auto& reader : readers) {
+        reader.join();
+    }
+}
+
+}  // namespace merge
@@ -0,0 +1,76 @@
+#include "zhist.hpp"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <string_view>
+
+namespace {
+
+constexpr std::size_t buffer_size = 1 << 16;
+
+}  // namespace
+
+Printer::Printer(int fd, ViewMode view_mode) : fd_(fd), view_mode_(view_mode) {
+    buf_.reserve(buffer_size);
+}
+
+Printer::~Printer() {
+    flush();
+}
+
+void Printer::print(std::string_view cmd) {
+    switch (view_mode_) {
+        case ViewMode::Normal: {
+            buf_.append(cmd);
+            buf_.push_back('\n');
+        } break;
+        case ViewMode::Escaped: {
+            append_escaped(cmd);
+            buf_.push_back('\n');
+        } break;
+        case ViewMode::FZF: {
+            append_escaped(cmd);
+            buf_.push_back('\t');
+            buf_.append(cmd);
+            buf_.push_back('\0');
+        } break;
+        case ViewMode::History: {
+            if (cmd.find('\n') == std::string_view::npos) {
+                buf_.append(cmd);
+                buf_.push_back('\n');
+            }
+        } break;
+    }
+
+    if (buf_.size() >= buffer_size) {
+        flush();
+    }
+}
+
+void Printer::flush() {
+    std::string_view rest = buf_;
+    while (!rest.empty()) {
+        auto n = write(fd_, rest.data(), rest.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        rest.remove_prefix(n);
+    }
+    buf_.clear();
+}
+
+void Printer::append_escaped(std::string_view cmd) {
+    for (char c : cmd) {
+        if (c == '\n') {
+            buf_.append("\\n");
+        } else if (c == '\t') {
+            buf_.append("\\t");
+        } else {
+            buf_.push_back(c);
+        }
+    }
+}
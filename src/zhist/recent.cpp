@@ -0,0 +1,201 @@
+#include "zhist.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr std::array<char, 4> magic = {'Z', 'H', 'R', 'C'};
+constexpr uint32_t version = 1;
+
+// a power of two, about 320 KiB of slots
+constexpr std::size_t num_slots = 8192;
+
+constexpr uint64_t fnv_offset = 0xcbf29ce484222325ULL;
+constexpr uint64_t fnv_prime = 0x100000001b3ULL;
+
+uint64_t fnv1a(uint64_t hash, std::string_view data) {
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * fnv_prime;
+    }
+    return hash;
+}
+
+}  // namespace
+
+struct RecentCache::Header {
+    std::array<char, 4> magic;
+    uint32_t version;
+    uint64_t num_slots;
+    // the inode of the database the ids belong to
+    uint64_t db_inode;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+// concurrent shells write slots without locking, so a torn slot is
+// detected by its check word and treated as empty
+struct RecentCache::Slot {
+    uint64_t key;
+    int64_t event_id;
+    int64_t command_id;
+    int64_t directory_id;
+    uint64_t check;
+
+    [[nodiscard]] uint64_t checksum() const {
+        constexpr uint64_t m1 = 0x9e3779b97f4a7c15ULL;
+        constexpr uint64_t m2 = 0xc2b2ae3d27d4eb4fULL;
+        constexpr uint64_t m3 = 0x165667b19e3779f9ULL;
+        return key ^ (static_cast<uint64_t>(event_id) * m1) ^
+               (static_cast<uint64_t>(command_id) * m2) ^
+               (static_cast<uint64_t>(directory_id) * m3);
+    }
+};
+
+RecentCache::RecentCache(const fs::path& db_path) {
+    struct stat db_st = {};
+    if (stat(db_path.c_str(), &db_st) != 0) {
+        return;
+    }
+
+    auto path = db_path;
+    path += ".recent";
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return;
+    }
+
+    auto size = sizeof(Header) + num_slots * sizeof(Slot);
+
+    struct stat st = {};
+    if (fstat(fd, &st) != 0 ||
+        (static_cast<std::size_t>(st.st_size) != size &&
+         ftruncate(fd, static_cast<off_t>(size)) != 0)) {
+        close(fd);
+        return;
+    }
+
+    void* addr =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return;
+    }
+
+    size_ = size;
+    header_ = static_cast<Header*>(addr);
+    slots_ =
+        reinterpret_cast<Slot*>(static_cast<char*>(addr) + sizeof(Header));
+
+    // a new file, another layout or a recreated database
+    if (header_->magic != magic || header_->version != version ||
+        header_->num_slots != num_slots ||
+        header_->db_inode != static_cast<uint64_t>(db_st.st_ino)) {
+        std::memset(addr, 0, size);
+        header_->magic = magic;
+        header_->version = version;
+        header_->num_slots = num_slots;
+        header_->db_inode = static_cast<uint64_t>(db_st.st_ino);
+    }
+}
+
+RecentCache::~RecentCache() {
+    if (header_ != nullptr) {
+        munmap(header_, size_);
+    }
+}
+
+uint64_t RecentCache::key(std::string_view cmd, std::string_view dir,
+                          int code) {
+    auto hash = fnv1a(fnv_offset, cmd);
+    hash = fnv1a(hash, std::string_view("\0", 1));
+    hash = fnv1a(hash, dir);
+    hash = fnv1a(hash, std::string_view("\0", 1));
+    return fnv1a(hash, std::string_view(reinterpret_cast<const char*>(&code),
+                                        sizeof(code)));
+}
+
+std::optional<RecentCache::Entry> RecentCache::find(uint64_t key) const {
+    if (slots_ == nullptr) {
+        return std::nullopt;
+    }
+
+    Slot slot;
+    std::memcpy(&slot, &slots_[key & (num_slots - 1)], sizeof(slot));
+    if (slot.key != key || slot.check != slot.checksum()) {
+        return std::nullopt;
+    }
+
+    return Entry{
+        .event_id = slot.event_id,
+        .command_id = slot.command_id,
+        .directory_id = slot.directory_id,
+    };
+}
+
+// the newest key wins its slot, so the cache keeps what was run recently
+void RecentCache::store(uint64_t key, const Entry& entry) {
+    if (slots_ == nullptr) {
+        return;
+    }
+
+    Slot slot = {
+        .key = key,
+        .event_id = entry.event_id,
+        .command_id = entry.command_id,
+        .directory_id = entry.directory_id,
+        .check = 0,
+    };
+    slot.check = slot.checksum();
+    std::memcpy(&slots_[key & (num_slots - 1)], &slot, sizeof(slot));
+}
+
+// the slots are cleared one by one, so concurrent writers at worst store
+// a slot that is cleared right after
+void RecentCache::clear() {
+    if (slots_ == nullptr) {
+        return;
+    }
+
+    for (std::size_t i = 0; i < num_slots; ++i) {
+        std::memset(&slots_[i], 0, sizeof(Slot));
+    }
+}
+
+void RecentCache::count_hit() {
+    if (header_ != nullptr) {
+        std::atomic_ref(header_->hits).fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void RecentCache::count_miss() {
+    if (header_ != nullptr) {
+        std::atomic_ref(header_->misses)
+            .fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+uint64_t RecentCache::hits() const {
+    return header_ != nullptr
+               ? std::atomic_ref(header_->hits).load(std::memory_order_relaxed)
+               : 0;
+}
+
+uint64_t RecentCache::misses() const {
+    return header_ != nullptr ? std::atomic_ref(header_->misses)
+                                    .load(std::memory_order_relaxed)
+                              : 0;
+}
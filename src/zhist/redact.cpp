@@ -0,0 +1,302 @@
+#include "zhist.hpp"
+
+#include <regex.h>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// [begin, end) of a secret in the command
+using Span = std::pair<std::size_t, std::size_t>;
+
+// a prefix only starts a secret at the start of a word, and the secret
+// goes on to the end of the shell word
+bool is_word_char(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') ||
+           (c >= 'a' && c <= 'z') || c == '_';
+}
+
+std::size_t word_end(std::string_view cmd, std::size_t pos) {
+    auto end = cmd.find_first_of(" \t\n'\"`;|&<>()", pos);
+    return end == std::string_view::npos ? cmd.size() : end;
+}
+
+// the text every match of the pattern starts with, or nothing when that
+// can't be told without parsing it
+std::string leading_literal(std::string_view pattern) {
+    constexpr std::string_view special = ".[]()*+?{}|^$\\";
+    constexpr std::string_view optional = "*?{";
+
+    if (pattern.find('|') != std::string_view::npos) {
+        return {};
+    }
+    if (pattern.starts_with('^')) {
+        pattern.remove_prefix(1);
+    }
+
+    auto size = std::min(pattern.find_first_of(special), pattern.size());
+    // a quantifier may repeat the last character zero times
+    if (size > 0 && size < pattern.size() &&
+        optional.find(pattern[size]) != std::string_view::npos) {
+        --size;
+    }
+    return std::string(pattern.substr(0, size));
+}
+
+std::string join_patterns(const std::vector<std::string>& patterns) {
+    std::string joined;
+    for (const auto& pattern : patterns) {
+        if (!joined.empty()) {
+            joined += '|';
+        }
+        joined += '(';
+        joined += pattern;
+        joined += ')';
+    }
+    return joined;
+}
+
+}  // namespace
+
+// the trie of the prefixes and the pattern literals with failure links.
+// the root, where most bytes of a command lead back to, gets a full table
+// and every other state a short sorted list of its edges
+struct Redactor::Automaton {
+    struct State {
+        std::vector<std::pair<unsigned char, int>> next;
+        int fail = 0;
+        // the length of the prefix ending here, or 0
+        std::size_t length = 0;
+        // whether the literal of a pattern ends here
+        bool is_literal = false;
+        // the nearest state down the failure links where something ends
+        int output = -1;
+
+        [[nodiscard]] bool is_end() const {
+            return length > 0 || is_literal;
+        }
+    };
+
+    std::vector<State> states;
+    std::array<int, 256> root_next{};
+
+    Automaton() : states(1) {}
+
+    void add_prefix(std::string_view prefix) {
+        states[add_string(prefix)].length = prefix.size();
+    }
+
+    void add_literal(std::string_view literal) {
+        states[add_string(literal)].is_literal = true;
+    }
+
+    // breadth first, so the failure link of a state is done before those
+    // of its children need it
+    void link() {
+        for (auto [c, target] : states[0].next) {
+            root_next.at(c) = target;
+        }
+
+        std::vector<int> queue;
+        for (auto [_, target] : states[0].next) {
+            queue.push_back(target);
+        }
+        for (std::size_t i = 0; i < queue.size(); ++i) {
+            auto state = queue[i];
+            for (auto [c, target] : states[state].next) {
+                auto fail = step(states[state].fail, c);
+                states[target].fail = fail;
+                states[target].output =
+                    states[fail].is_end() ? fail : states[fail].output;
+                queue.push_back(target);
+            }
+        }
+    }
+
+    [[nodiscard]] int step(int state, unsigned char c) const {
+        int next = 0;
+        while ((next = edge(state, c)) < 0) {
+            state = states[state].fail;
+        }
+        return next;
+    }
+
+private:
+    [[nodiscard]] int edge(int state, unsigned char c) const {
+        if (state == 0) {
+            return root_next.at(c);
+        }
+        const auto& next = states[state].next;
+        auto it = std::ranges::lower_bound(
+            next, c, {}, &std::pair<unsigned char, int>::first);
+        return it != next.end() && it->first == c ? it->second : -1;
+    }
+
+    int add_string(std::string_view text) {
+        int state = 0;
+        for (auto ch : text) {
+            auto c = static_cast<unsigned char>(ch);
+            auto& next = states[state].next;
+            auto it = std::ranges::lower_bound(
+                next, c, {}, &std::pair<unsigned char, int>::first);
+            if (it != next.end() && it->first == c) {
+                state = it->second;
+                continue;
+            }
+            auto target = static_cast<int>(states.size());
+            next.insert(it, {c, target});
+            states.emplace_back();
+            state = target;
+        }
+        return state;
+    }
+};
+
+// the alternation of the patterns as one regex, compiled the first time
+// a command needs it
+struct Redactor::Patterns {
+    std::vector<std::string> patterns;
+    // a pattern without a literal has to be tried on every command
+    bool is_always_run = false;
+    std::optional<regex_t> regex;
+
+    Patterns() = default;
+    ~Patterns() {
+        if (regex) {
+            regfree(&*regex);
+        }
+    }
+
+    Patterns(const Patterns&) = delete;
+    Patterns& operator=(const Patterns&) = delete;
+    Patterns(Patterns&&) = delete;
+    Patterns& operator=(Patterns&&) = delete;
+
+    const regex_t& compiled() {
+        if (regex) {
+            return *regex;
+        }
+
+        regex_t re = {};
+        if (regcomp(&re, join_patterns(patterns).c_str(), REG_EXTENDED) !=
+            0) {
+            // the patterns are checked one by one only to name the culprit
+            for (const auto& pattern : patterns) {
+                if (regcomp(&re, pattern.c_str(), REG_EXTENDED | REG_NOSUB) !=
+                    0) {
+                    throw std::runtime_error("invalid redaction pattern: " +
+                                             pattern);
+                }
+                regfree(&re);
+            }
+            throw std::runtime_error("invalid redaction patterns");
+        }
+        return regex.emplace(re);
+    }
+};
+
+Redactor::Redactor(const Redaction& redaction) {
+    if (redaction.prefixes.empty() && redaction.patterns.empty()) {
+        return;
+    }
+
+    automaton_ = std::make_unique<Automaton>();
+    for (const auto& prefix : redaction.prefixes) {
+        if (!prefix.empty()) {
+            automaton_->add_prefix(prefix);
+        }
+    }
+
+    if (!redaction.patterns.empty()) {
+        patterns_ = std::make_unique<Patterns>();
+        patterns_->patterns = redaction.patterns;
+        for (const auto& pattern : redaction.patterns) {
+            auto literal = leading_literal(pattern);
+            if (literal.empty()) {
+                patterns_->is_always_run = true;
+            } else {
+                automaton_->add_literal(literal);
+            }
+        }
+    }
+
+    automaton_->link();
+}
+
+Redactor::~Redactor() = default;
+
+std::optional<std::string> Redactor::redact(std::string_view cmd) {
+    if (!automaton_) {
+        return std::nullopt;
+    }
+
+    std::vector<Span> spans;
+    bool has_literal = false;
+
+    const auto& states = automaton_->states;
+    int state = 0;
+    for (std::size_t i = 0; i < cmd.size(); ++i) {
+        state = automaton_->step(state, static_cast<unsigned char>(cmd[i]));
+        for (int out = states[state].is_end() ? state : states[state].output;
+             out >= 0; out = states[out].output) {
+            has_literal = has_literal || states[out].is_literal;
+            if (states[out].length == 0) {
+                continue;
+            }
+            auto begin = i + 1 - states[out].length;
+            if (begin == 0 || !is_word_char(cmd[begin - 1])) {
+                spans.emplace_back(begin, word_end(cmd, i + 1));
+            }
+        }
+    }
+
+    // REG_STARTEND matches within the view, which needs no terminating NUL
+    if (patterns_ && (has_literal || patterns_->is_always_run)) {
+        const auto& regex = patterns_->compiled();
+
+        std::size_t pos = 0;
+        while (pos <= cmd.size()) {
+            regmatch_t match = {.rm_so = static_cast<regoff_t>(pos),
+                                .rm_eo = static_cast<regoff_t>(cmd.size())};
+            auto flags = REG_STARTEND | (pos > 0 ? REG_NOTBOL : 0);
+            if (regexec(&regex, cmd.data(), 1, &match, flags) != 0) {
+                break;
+            }
+            auto begin = static_cast<std::size_t>(match.rm_so);
+            auto end = static_cast<std::size_t>(match.rm_eo);
+            if (end > begin) {
+                spans.emplace_back(begin, end);
+            }
+            pos = std::max(end, begin + 1);
+        }
+    }
+
+    if (spans.empty()) {
+        return std::nullopt;
+    }
+
+    // overlapping secrets are replaced by one placeholder
+    std::ranges::sort(spans);
+    std::string redacted;
+    std::size_t pos = 0;
+    for (auto [begin, end] : spans) {
+        if (end <= pos) {
+            continue;
+        }
+        if (begin >= pos) {
+            redacted.append(cmd.substr(pos, begin - pos));
+            redacted.append(placeholder);
+        }
+        pos = end;
+    }
+    redacted.append(cmd.substr(pos));
+    return redacted;
+}
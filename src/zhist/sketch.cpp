@@ -0,0 +1,125 @@
+#include "zhist.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace {
+
+// values in a bin are within 2% of the value it reports
+constexpr double relative_accuracy = 0.02;
+// bin i holds the durations in (bin_ratio^(i-1), bin_ratio^i]
+const double bin_ratio = (1 + relative_accuracy) / (1 - relative_accuracy);
+const double log_bin_ratio = std::log(bin_ratio);
+
+// the value within the relative accuracy of everything in the bin
+double bin_value(int32_t index) {
+    return 2 * std::pow(bin_ratio, index) / (bin_ratio + 1);
+}
+
+void put(std::string& data, uint64_t value) {
+    while (value >= 0x80) {
+        data.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    data.push_back(static_cast<char>(value));
+}
+
+uint64_t get(std::string_view& data) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64 && !data.empty(); shift += 7) {
+        auto byte = static_cast<uint8_t>(data.front());
+        data.remove_prefix(1);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw std::runtime_error("duration sketch is corrupt");
+}
+
+}  // namespace
+
+// a duration of 0 ms has a bin of its own, as its logarithm has none
+void DurationSketch::add(int64_t duration_ms) {
+    if (duration_ms <= 0) {
+        ++zero_count_;
+        return;
+    }
+
+    auto index = static_cast<int32_t>(
+        std::ceil(std::log(static_cast<double>(duration_ms)) / log_bin_ratio));
+    ++bins_[index];
+}
+
+void DurationSketch::merge(const DurationSketch& other) {
+    zero_count_ += other.zero_count_;
+    for (auto [index, count] : other.bins_) {
+        bins_[index] += count;
+    }
+}
+
+uint64_t DurationSketch::count() const {
+    auto count = zero_count_;
+    for (auto [_, bin_count] : bins_) {
+        count += bin_count;
+    }
+    return count;
+}
+
+std::optional<double> DurationSketch::quantile(double q) const {
+    auto total = count();
+    if (total == 0) {
+        return std::nullopt;
+    }
+
+    auto rank = q * static_cast<double>(total - 1);
+    auto seen = static_cast<double>(zero_count_);
+    if (rank < seen) {
+        return 0.0;
+    }
+
+    for (auto [index, count] : bins_) {
+        seen += static_cast<double>(count);
+        if (rank < seen) {
+            return bin_value(index);
+        }
+    }
+    return bin_value(bins_.rbegin()->first);
+}
+
+// the zero count and the number of bins, then each bin as the zigzag delta
+// of its index and its count
+std::string DurationSketch::encode() const {
+    std::string data;
+    put(data, zero_count_);
+    put(data, bins_.size());
+
+    int64_t prev = 0;
+    for (auto [index, count] : bins_) {
+        int64_t delta = index - prev;
+        put(data, (static_cast<uint64_t>(delta) << 1) ^
+                      static_cast<uint64_t>(delta >> 63));
+        put(data, count);
+        prev = index;
+    }
+    return data;
+}
+
+DurationSketch DurationSketch::decode(std::string_view data) {
+    DurationSketch sketch;
+    sketch.zero_count_ = get(data);
+
+    auto num_bins = get(data);
+    int64_t index = 0;
+    for (uint64_t i = 0; i < num_bins; ++i) {
+        auto delta = get(data);
+        index += static_cast<int64_t>(delta >> 1) ^
+                 -static_cast<int64_t>(delta & 1);
+        sketch.bins_[static_cast<int32_t>(index)] += get(data);
+    }
+    return sketch;
+}
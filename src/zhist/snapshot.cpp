@@ -0,0 +1,492 @@
+#include "zhist.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sqlite3.h>
+
+#ifdef ZHIST_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// the dictionaries are written sorted, so that neighbours share prefixes
+constexpr auto sql_select_commands = R"sql(
+    SELECT id, command FROM commands ORDER BY command
+)sql";
+
+constexpr auto sql_select_directories = R"sql(
+    SELECT id, directory FROM directories ORDER BY directory
+)sql";
+
+// oldest first, so the times are small deltas. untimed events sort first
+constexpr auto sql_select_events = R"sql(
+    SELECT command_id, directory_id, return_code, time FROM events
+    ORDER BY time, id
+)sql";
+
+namespace {
+
+// a snapshot is the magic, the format version, the codec and the body:
+//
+//   commands     count, then (shared prefix, suffix size, suffix) each
+//   directories  the same
+//   events       count and the number of untimed events, then one column
+//                of varints per field
+//
+// command and directory columns hold dictionary indexes, with 0 for no
+// directory and i + 1 otherwise. return codes are zigzag encoded, also
+// shifted by one for none. times are zigzag deltas from the previous one
+constexpr std::array<char, 4> magic = {'Z', 'H', 'S', 'N'};
+constexpr uint8_t version = 1;
+
+enum class Codec : uint8_t {
+    None,
+    Zstd,
+};
+
+constexpr std::size_t header_size = magic.size() + 2;
+
+#ifdef ZHIST_WITH_ZSTD
+constexpr int zstd_level = 9;
+#endif
+
+uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^
+           static_cast<uint64_t>(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+class Writer {
+public:
+    void put(uint64_t value) {
+        while (value >= 0x80) {
+            data_.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        data_.push_back(static_cast<char>(value));
+    }
+
+    void put_signed(int64_t value) {
+        put(zigzag(value));
+    }
+
+    void put_bytes(std::string_view bytes) {
+        data_.append(bytes);
+    }
+
+    std::string& data() {
+        return data_;
+    }
+
+private:
+    std::string data_;
+};
+
+class Reader {
+public:
+    explicit Reader(std::string_view data) : data_(data) {}
+
+    uint64_t get() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            auto byte = static_cast<uint8_t>(get_bytes(1)[0]);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        throw std::runtime_error("snapshot is corrupt");
+    }
+
+    int64_t get_signed() {
+        return unzigzag(get());
+    }
+
+    std::string_view get_bytes(std::size_t size) {
+        if (data_.size() < size) {
+            throw std::runtime_error("snapshot is truncated");
+        }
+        auto bytes = data_.substr(0, size);
+        data_.remove_prefix(size);
+        return bytes;
+    }
+
+    // a count that can't be larger than what is left to read
+    std::size_t get_count() {
+        auto count = get();
+        if (count > data_.size()) {
+            throw std::runtime_error("snapshot is corrupt");
+        }
+        return static_cast<std::size_t>(count);
+    }
+
+private:
+    std::string_view data_;
+};
+
+// writes the texts and returns the dictionary index of each id
+std::unordered_map<int64_t, uint64_t> put_dictionary(sql::Session& session,
+                                                     const char* select_sql,
+                                                     Writer& writer) {
+    std::vector<std::pair<int64_t, std::string>> entries;
+    {
+        auto stmt = session.prepare(select_sql);
+        while (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+            const auto* text = reinterpret_cast<const char*>(
+                sqlite3_column_text(stmt.get(), 1));
+            auto size = sqlite3_column_bytes(stmt.get(), 1);
+            entries.emplace_back(sqlite3_column_int64(stmt.get(), 0),
+                                 std::string(text, size));
+        }
+    }
+
+    std::unordered_map<int64_t, uint64_t> indexes;
+    indexes.reserve(entries.size());
+
+    writer.put(entries.size());
+    std::string_view prev;
+    for (const auto& [id, text] : entries) {
+        auto shared = std::ranges::mismatch(prev, text).in2 - text.begin();
+        writer.put(shared);
+        writer.put(text.size() - shared);
+        writer.put_bytes(std::string_view(text).substr(shared));
+        prev = text;
+
+        indexes.emplace(id, indexes.size());
+    }
+    return indexes;
+}
+
+std::vector<std::string> get_dictionary(Reader& reader) {
+    std::vector<std::string> texts(reader.get_count());
+    std::string_view prev;
+    for (auto& text : texts) {
+        auto shared = reader.get();
+        auto suffix_size = reader.get_count();
+        if (shared > prev.size()) {
+            throw std::runtime_error("snapshot is corrupt");
+        }
+        text.reserve(shared + suffix_size);
+        text.append(prev.substr(0, shared));
+        text.append(reader.get_bytes(suffix_size));
+        prev = text;
+    }
+    return texts;
+}
+
+uint64_t lookup(const std::unordered_map<int64_t, uint64_t>& indexes,
+                int64_t id) {
+    auto it = indexes.find(id);
+    if (it == indexes.end()) {
+        throw std::runtime_error("event refers to a missing row");
+    }
+    return it->second;
+}
+
+std::string compress(std::string body) {
+    std::string data(magic.begin(), magic.end());
+    data.push_back(static_cast<char>(version));
+
+#ifdef ZHIST_WITH_ZSTD
+    std::string frame(ZSTD_compressBound(body.size()), '\0');
+    auto size = ZSTD_compress(frame.data(), frame.size(), body.data(),
+                              body.size(), zstd_level);
+    if (!ZSTD_isError(size) && size < body.size()) {
+        frame.resize(size);
+        data.push_back(static_cast<char>(Codec::Zstd));
+        data.append(frame);
+        return data;
+    }
+#endif
+
+    data.push_back(static_cast<char>(Codec::None));
+    data.append(body);
+    return data;
+}
+
+std::string decompress(std::string_view data) {
+    if (data.size() < header_size ||
+        !std::equal(magic.begin(), magic.end(), data.begin())) {
+        throw std::runtime_error("not a zhist snapshot");
+    }
+    auto snapshot_version = static_cast<uint8_t>(data[magic.size()]);
+    if (snapshot_version != version) {
+        throw std::runtime_error("snapshot v" +
+                                 std::to_string(snapshot_version) +
+                                 " is not supported by this zhist");
+    }
+
+    auto codec = static_cast<Codec>(data[magic.size() + 1]);
+    data.remove_prefix(header_size);
+
+    switch (codec) {
+        case Codec::None:
+            return std::string(data);
+        case Codec::Zstd: {
+#ifdef ZHIST_WITH_ZSTD
+            auto size = ZSTD_getFrameContentSize(data.data(), data.size());
+            if (size == ZSTD_CONTENTSIZE_UNKNOWN ||
+                size == ZSTD_CONTENTSIZE_ERROR) {
+                throw std::runtime_error("snapshot is corrupt");
+            }
+            std::string body(size, '\0');
+            auto n = ZSTD_decompress(body.data(), body.size(), data.data(),
+                                     data.size());
+            if (ZSTD_isError(n) || n != size) {
+                throw std::runtime_error("snapshot is corrupt");
+            }
+            return body;
+#else
+            throw std::runtime_error(
+                "snapshot is compressed with zstd, which this zhist was built "
+                "without");
+#endif
+        }
+    }
+    throw std::runtime_error("snapshot codec is not supported");
+}
+
+// interns each dictionary entry the first time an event uses it
+class Interner {
+public:
+    Interner(std::vector<std::string> texts,
+             int64_t (*intern)(sql::Session&, std::string_view))
+        : texts_(std::move(texts)), ids_(texts_.size()), intern_(intern) {}
+
+    int64_t id(sql::Session& session, std::size_t index) {
+        auto& id = ids_.at(index);
+        if (!id) {
+            id = intern_(session, texts_[index]);
+        }
+        return *id;
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return texts_.size();
+    }
+
+private:
+    std::vector<std::string> texts_;
+    std::vector<std::optional<int64_t>> ids_;
+    int64_t (*intern_)(sql::Session&, std::string_view);
+};
+
+[[noreturn]] void throw_errno(const std::string& what, const fs::path& path) {
+    throw std::runtime_error(what + " " + path.string() + ": " +
+                             std::strerror(errno));
+}
+
+}  // namespace
+
+namespace snapshot {
+
+std::size_t dump(sql::Session& session, std::string& data) {
+    Writer writer;
+
+    auto commands = put_dictionary(session, sql_select_commands, writer);
+    auto directories = put_dictionary(session, sql_select_directories, writer);
+
+    std::vector<uint64_t> command_column;
+    std::vector<uint64_t> directory_column;
+    std::vector<uint64_t> code_column;
+    std::vector<int64_t> time_column;
+    {
+        auto stmt = session.prepare(sql_select_events);
+        while (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+            auto* s = stmt.get();
+            command_column.push_back(
+                lookup(commands, sqlite3_column_int64(s, 0)));
+            directory_column.push_back(
+                sqlite3_column_type(s, 1) == SQLITE_NULL
+                    ? 0
+                    : lookup(directories, sqlite3_column_int64(s, 1)) + 1);
+            code_column.push_back(
+                sqlite3_column_type(s, 2) == SQLITE_NULL
+                    ? 0
+                    : zigzag(sqlite3_column_int(s, 2)) + 1);
+            if (sqlite3_column_type(s, 3) != SQLITE_NULL) {
+                time_column.push_back(sqlite3_column_int64(s, 3));
+            }
+        }
+    }
+
+    writer.put(command_column.size());
+    writer.put(command_column.size() - time_column.size());
+    for (auto index : command_column) {
+        writer.put(index);
+    }
+    for (auto index : directory_column) {
+        writer.put(index);
+    }
+    for (auto code : code_column) {
+        writer.put(code);
+    }
+    int64_t prev = 0;
+    for (auto time : time_column) {
+        writer.put_signed(time - prev);
+        prev = time;
+    }
+
+    data = compress(std::move(writer.data()));
+    return command_column.size();
+}
+
+Counts restore(sql::Session& session, std::string_view data, int batch_size) {
+    auto body = decompress(data);
+    Reader reader(body);
+
+    Interner commands(get_dictionary(reader), sql::intern_command);
+    Interner directories(get_dictionary(reader), sql::intern_directory);
+
+    auto num_events = reader.get_count();
+    auto num_untimed = reader.get();
+    if (num_untimed > num_events) {
+        throw std::runtime_error("snapshot is corrupt");
+    }
+
+    // the columns are read in full, so a damaged snapshot changes nothing
+    std::vector<uint64_t> columns(num_events * 3);
+    for (auto& value : columns) {
+        value = reader.get();
+    }
+    std::vector<std::optional<int64_t>> times(num_events);
+    int64_t prev = 0;
+    for (auto i = num_untimed; i < num_events; ++i) {
+        prev += reader.get_signed();
+        times[i] = prev;
+    }
+
+    for (std::size_t i = 0; i < num_events; ++i) {
+        if (columns[i] >= commands.size() ||
+            columns[num_events + i] > directories.size()) {
+            throw std::runtime_error("snapshot is corrupt");
+        }
+    }
+
+    Counts counts = {.num_events = num_events, .num_merged = 0};
+    auto batch = static_cast<std::size_t>(std::max(batch_size, 1));
+
+    for (std::size_t i = 0; i < num_events; i += batch) {
+        auto last = std::min(num_events, i + batch);
+
+        sql::Transaction transaction(session);
+        for (auto j = i; j < last; ++j) {
+            auto command_id = commands.id(session, columns[j]);
+
+            std::optional<int64_t> directory_id;
+            if (auto index = columns[num_events + j]; index != 0) {
+                directory_id = directories.id(session, index - 1);
+            }
+
+            std::optional<int> code;
+            if (auto value = columns[2 * num_events + j]; value != 0) {
+                code = static_cast<int>(unzigzag(value - 1));
+            }
+
+            if (sql::merge_event(session, command_id, directory_id, code,
+                                 times[j])) {
+                ++counts.num_merged;
+            }
+        }
+        transaction.commit();
+    }
+
+    return counts;
+}
+
+std::string load(const fs::path& path) {
+    int fd = path == "-" ? STDIN_FILENO
+                         : open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw_errno("cannot open", path);
+    }
+
+    std::string data;
+    std::array<char, 1 << 16> buf{};
+    for (;;) {
+        auto n = read(fd, buf.data(), buf.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0) {
+                auto err = errno;
+                close(fd);
+                errno = err;
+                throw_errno("cannot read", path);
+            }
+            break;
+        }
+        data.append(buf.data(), n);
+    }
+
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return data;
+}
+
+// a file is written next to its destination and renamed over it, so a
+// sync never picks up half a snapshot
+void save(const fs::path& path, std::string_view data) {
+    auto tmp_path = path;
+    tmp_path += ".tmp";
+
+    int fd = path == "-" ? STDOUT_FILENO
+                         : open(tmp_path.c_str(),
+                                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        throw_errno("cannot create", tmp_path);
+    }
+
+    while (!data.empty()) {
+        auto n = write(fd, data.data(), data.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            auto err = errno;
+            if (fd != STDOUT_FILENO) {
+                close(fd);
+                unlink(tmp_path.c_str());
+            }
+            errno = err;
+            throw_errno("cannot write", path);
+        }
+        data.remove_prefix(n);
+    }
+
+    if (fd == STDOUT_FILENO) {
+        return;
+    }
+    auto synced = fsync(fd) == 0;
+    if (close(fd) != 0 || !synced) {
+        unlink(tmp_path.c_str());
+        throw_errno("cannot write", tmp_path);
+    }
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        throw_errno("cannot rename", tmp_path);
+    }
+}
+
+}  // namespace snapshot
@@ -1,51 +1,250 @@
 #include "zhist.hpp"
 
 #include <cstdint>
+#include <optional>
 #include <string>
+#include <string_view>
 
 #include <sqlite3.h>
 
+constexpr auto sql_select_command_id = R"sql(
+    SELECT id FROM commands WHERE command = ?
+)sql";
+
+constexpr auto sql_insert_command_id = R"sql(
+    INSERT INTO commands (command) VALUES (?)
+)sql";
+
+constexpr auto sql_select_directory_id = R"sql(
+    SELECT id FROM directories WHERE directory = ?
+)sql";
+
+constexpr auto sql_insert_directory_id = R"sql(
+    INSERT INTO directories (directory) VALUES (?)
+)sql";
+
+// updates the row in place, where REPLACE would delete it and insert a new
+// one with a new rowid. the event keeps the duration of its latest run
 constexpr auto sql_insert = R"sql(
-    INSERT OR REPLACE INTO histories (command, directory, return_code, time)
-    VALUES (?, ?, ?, ?)
+    INSERT INTO events (
+        command_id, directory_id, return_code, time, duration_ms
+    )
+    VALUES (?, ?, ?, ?, ?)
+    ON CONFLICT (command_id, directory_id, return_code) DO UPDATE SET
+        time = excluded.time,
+        duration_ms = excluded.duration_ms
+    RETURNING id
+)sql";
+
+// the ids come from the recent cache, so they are checked against the row
+constexpr auto sql_update_event = R"sql(
+    UPDATE events SET time = ?5, duration_ms = ?6
+    WHERE id = ?1 AND command_id = ?2 AND directory_id = ?3
+      AND return_code = ?4
+)sql";
+
+constexpr auto sql_update_command = R"sql(
+    UPDATE events SET time = coalesce(max(time, ?2), time, ?2)
+    WHERE command_id = ?1 AND directory_id IS NULL AND return_code IS NULL
 )sql";
 
 constexpr auto sql_insert_command = R"sql(
-    INSERT OR IGNORE INTO histories (command) VALUES (?)
+    INSERT INTO events (command_id, time) VALUES (?, ?)
 )sql";
 
+// the key may hold NULLs, which UNIQUE never matches, so rows are looked
+// up with IS
+constexpr auto sql_select_event = R"sql(
+    SELECT id, time FROM events
+    WHERE command_id = ?1 AND directory_id IS ?2 AND return_code IS ?3
+)sql";
+
+constexpr auto sql_insert_event = R"sql(
+    INSERT INTO events (command_id, directory_id, return_code, time)
+    VALUES (?, ?, ?, ?)
+)sql";
+
+constexpr auto sql_update_event_time = R"sql(
+    UPDATE events SET time = ? WHERE id = ?
+)sql";
+
+namespace {
+
+int64_t intern(sql::Session& session, const char* select_sql,
+               const char* insert_sql, std::string_view text) {
+    {
+        auto stmt = session.prepare(select_sql);
+        sqlite3_bind_text(stmt.get(), 1, text.data(),
+                          static_cast<int>(text.size()), SQLITE_STATIC);
+        if (session.step(stmt) == SQLITE_ROW) {
+            return sqlite3_column_int64(stmt.get(), 0);
+        }
+    }
+
+    auto stmt = session.prepare(insert_sql);
+    sqlite3_bind_text(stmt.get(), 1, text.data(),
+                      static_cast<int>(text.size()), SQLITE_STATIC);
+    session.step(stmt);
+
+    return sqlite3_last_insert_rowid(session.get());
+}
+
+}  // namespace
+
 namespace sql {
 
-void insert(sqlite3* db, const std::string& cmd, const std::string& dir,
-            int code, int64_t time) {
-    sqlite3_stmt* stmt = nullptr;
-    int rc = sqlite3_prepare_v2(db, sql_insert, -1, &stmt, nullptr);
-    if (rc != SQLITE_OK) {
-        return;
+int64_t intern_command(Session& session, std::string_view cmd) {
+    return intern(session, sql_select_command_id, sql_insert_command_id, cmd);
+}
+
+int64_t intern_directory(Session& session, std::string_view dir) {
+    return intern(session, sql_select_directory_id, sql_insert_directory_id,
+                  dir);
+}
+
+void insert(Session& session, RecentCache& cache, const std::string& cmd,
+            const std::string& dir, int code, int64_t time,
+            std::optional<int64_t> duration) {
+    auto key = RecentCache::key(cmd, dir, code);
+
+    if (auto entry = cache.find(key)) {
+        auto stmt = session.prepare(sql_update_event);
+
+        sqlite3_bind_int64(stmt.get(), 1, entry->event_id);
+        sqlite3_bind_int64(stmt.get(), 2, entry->command_id);
+        sqlite3_bind_int64(stmt.get(), 3, entry->directory_id);
+        sqlite3_bind_int(stmt.get(), 4, code);
+        sqlite3_bind_int64(stmt.get(), 5, time);
+        if (duration) {
+            sqlite3_bind_int64(stmt.get(), 6, *duration);
+        }
+
+        if (session.step(stmt) == SQLITE_DONE &&
+            sqlite3_changes(session.get()) == 1) {
+            cache.count_hit();
+            update_stats(session, entry->command_id, entry->directory_id, code,
+                         time);
+            if (duration) {
+                record_duration(session, entry->command_id, time, *duration);
+            }
+            return;
+        }
+    }
+
+    cache.count_miss();
+
+    auto command_id = intern_command(session, cmd);
+    auto directory_id = intern_directory(session, dir);
+
+    {
+        auto stmt = session.prepare(sql_insert);
+
+        sqlite3_bind_int64(stmt.get(), 1, command_id);
+        sqlite3_bind_int64(stmt.get(), 2, directory_id);
+        sqlite3_bind_int(stmt.get(), 3, code);
+        sqlite3_bind_int64(stmt.get(), 4, time);
+        if (duration) {
+            sqlite3_bind_int64(stmt.get(), 5, *duration);
+        }
+
+        if (session.step(stmt) == SQLITE_ROW) {
+            RecentCache::Entry entry = {
+                .event_id = sqlite3_column_int64(stmt.get(), 0),
+                .command_id = command_id,
+                .directory_id = directory_id,
+            };
+            cache.store(key, entry);
+        }
     }
 
-    sqlite3_bind_text(stmt, 1, cmd.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, dir.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(stmt, 3, code);
-    sqlite3_bind_int64(stmt, 4, time);
+    update_stats(session, command_id, directory_id, code, time);
+    if (duration) {
+        record_duration(session, command_id, time, *duration);
+    }
+}
 
-    rc = sqlite3_step(stmt);
+void insert(Session& session, std::string_view cmd,
+            std::optional<int64_t> time) {
+    auto command_id = intern_command(session, cmd);
 
-    sqlite3_finalize(stmt);
+    auto bind = [&](sqlite3_stmt* stmt) {
+        sqlite3_bind_int64(stmt, 1, command_id);
+        if (time) {
+            sqlite3_bind_int64(stmt, 2, *time);
+        }
+    };
+
+    {
+        auto stmt = session.prepare(sql_update_command);
+        bind(stmt.get());
+        session.step(stmt);
+    }
+
+    if (sqlite3_changes(session.get()) == 0) {
+        {
+            auto stmt = session.prepare(sql_insert_command);
+            bind(stmt.get());
+            session.step(stmt);
+        }
+
+        update_stats(session, command_id, std::nullopt, std::nullopt, time);
+    }
 }
 
-void insert(sqlite3* db, const std::string& cmd) {
-    sqlite3_stmt* stmt = nullptr;
-    int rc = sqlite3_prepare_v2(db, sql_insert_command, -1, &stmt, nullptr);
-    if (rc != SQLITE_OK) {
-        return;
+// an event that is new, or newer than the copy in the database, counts as
+// one more run, so merging the same events twice changes nothing
+bool merge_event(Session& session, int64_t command_id,
+                 std::optional<int64_t> directory_id, std::optional<int> code,
+                 std::optional<int64_t> time) {
+    std::optional<int64_t> event_id;
+    std::optional<int64_t> event_time;
+    {
+        auto stmt = session.prepare(sql_select_event);
+
+        sqlite3_bind_int64(stmt.get(), 1, command_id);
+        if (directory_id) {
+            sqlite3_bind_int64(stmt.get(), 2, *directory_id);
+        }
+        if (code) {
+            sqlite3_bind_int(stmt.get(), 3, *code);
+        }
+
+        if (session.step(stmt) == SQLITE_ROW) {
+            event_id = sqlite3_column_int64(stmt.get(), 0);
+            if (sqlite3_column_type(stmt.get(), 1) != SQLITE_NULL) {
+                event_time = sqlite3_column_int64(stmt.get(), 1);
+            }
+        }
     }
 
-    sqlite3_bind_text(stmt, 1, cmd.c_str(), -1, SQLITE_TRANSIENT);
+    if (!event_id) {
+        auto stmt = session.prepare(sql_insert_event);
+
+        sqlite3_bind_int64(stmt.get(), 1, command_id);
+        if (directory_id) {
+            sqlite3_bind_int64(stmt.get(), 2, *directory_id);
+        }
+        if (code) {
+            sqlite3_bind_int(stmt.get(), 3, *code);
+        }
+        if (time) {
+            sqlite3_bind_int64(stmt.get(), 4, *time);
+        }
 
-    rc = sqlite3_step(stmt);
+        session.step(stmt);
+    } else if (time && (!event_time || *event_time < *time)) {
+        auto stmt = session.prepare(sql_update_event_time);
+
+        sqlite3_bind_int64(stmt.get(), 1, *time);
+        sqlite3_bind_int64(stmt.get(), 2, *event_id);
+
+        session.step(stmt);
+    } else {
+        return false;
+    }
 
-    sqlite3_finalize(stmt);
+    update_stats(session, command_id, directory_id, code, time);
+    return true;
 }
 
 }  // namespace sql
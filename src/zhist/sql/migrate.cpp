@@ -0,0 +1,327 @@
+#include "zhist.hpp"
+
+#include <array>
+#include <stdexcept>
+#include <string>
+
+#include <sqlite3.h>
+
+constexpr auto sql_get_user_version = R"sql(
+    PRAGMA user_version
+)sql";
+
+constexpr auto sql_v1_schema = R"sql(
+    CREATE TABLE IF NOT EXISTS histories (
+        id INTEGER PRIMARY KEY,
+        command TEXT NOT NULL,
+        directory TEXT,
+        return_code INTEGER,
+        time INTEGER,
+        UNIQUE(command, directory, return_code)
+    );
+
+    CREATE INDEX IF NOT EXISTS idx_filter ON histories(return_code, directory, time);
+)sql";
+
+constexpr auto sql_v2_create_tables = R"sql(
+    CREATE TABLE commands (
+        id INTEGER PRIMARY KEY,
+        command TEXT NOT NULL UNIQUE
+    );
+
+    CREATE TABLE directories (
+        id INTEGER PRIMARY KEY,
+        directory TEXT NOT NULL UNIQUE
+    );
+
+    CREATE TABLE events (
+        id INTEGER PRIMARY KEY,
+        command_id INTEGER NOT NULL REFERENCES commands(id),
+        directory_id INTEGER REFERENCES directories(id),
+        return_code INTEGER,
+        time INTEGER,
+        UNIQUE(command_id, directory_id, return_code)
+    );
+)sql";
+
+constexpr auto sql_v2_copy_commands = R"sql(
+    INSERT OR IGNORE INTO commands (command)
+    SELECT command FROM histories ORDER BY id;
+)sql";
+
+constexpr auto sql_v2_copy_directories = R"sql(
+    INSERT OR IGNORE INTO directories (directory)
+    SELECT directory FROM histories WHERE directory IS NOT NULL ORDER BY id;
+)sql";
+
+constexpr auto sql_v2_copy_events = R"sql(
+    INSERT INTO events (command_id, directory_id, return_code, time)
+    SELECT c.id, d.id, h.return_code, h.time FROM histories AS h
+    JOIN commands AS c ON c.command = h.command
+    LEFT JOIN directories AS d ON d.directory = h.directory
+    ORDER BY h.id;
+)sql";
+
+// the search and stats tables of unversioned databases refer to histories
+// by command text, so they are rebuilt rather than converted
+constexpr auto sql_v2_drop_histories = R"sql(
+    DROP TRIGGER IF EXISTS histories_fts_insert;
+    DROP TRIGGER IF EXISTS histories_fts_delete;
+    DROP TRIGGER IF EXISTS histories_fts_update;
+    DROP TABLE IF EXISTS histories_fts;
+    DROP TABLE IF EXISTS command_stats;
+    DROP TABLE IF EXISTS command_directory_stats;
+    DROP TABLE histories;
+)sql";
+
+constexpr auto sql_v2_create_views = R"sql(
+    CREATE INDEX idx_filter ON events(return_code, directory_id, time);
+
+    CREATE VIEW histories AS
+    SELECT e.id, c.command, d.directory, e.return_code, e.time
+    FROM events AS e
+    JOIN commands AS c ON c.id = e.command_id
+    LEFT JOIN directories AS d ON d.id = e.directory_id;
+)sql";
+
+constexpr auto sql_v2_create_search = R"sql(
+    CREATE VIRTUAL TABLE commands_fts USING fts5(
+        command,
+        content = 'commands',
+        content_rowid = 'id',
+        tokenize = 'trigram'
+    );
+
+    CREATE TRIGGER commands_fts_insert AFTER INSERT ON commands BEGIN
+        INSERT INTO commands_fts (rowid, command)
+        VALUES (new.id, new.command);
+    END;
+
+    CREATE TRIGGER commands_fts_delete AFTER DELETE ON commands BEGIN
+        INSERT INTO commands_fts (commands_fts, rowid, command)
+        VALUES ('delete', old.id, old.command);
+    END;
+
+    CREATE TRIGGER commands_fts_update AFTER UPDATE OF command ON commands
+    BEGIN
+        INSERT INTO commands_fts (commands_fts, rowid, command)
+        VALUES ('delete', old.id, old.command);
+        INSERT INTO commands_fts (rowid, command)
+        VALUES (new.id, new.command);
+    END;
+
+    INSERT INTO commands_fts (commands_fts) VALUES ('rebuild');
+)sql";
+
+constexpr auto sql_v2_create_stats = R"sql(
+    CREATE TABLE command_stats (
+        command_id INTEGER PRIMARY KEY REFERENCES commands(id),
+        count INTEGER NOT NULL,
+        success_count INTEGER NOT NULL,
+        last_time INTEGER,
+        score REAL NOT NULL
+    );
+
+    CREATE INDEX idx_command_stats_score ON command_stats(score);
+
+    CREATE TABLE command_directory_stats (
+        command_id INTEGER NOT NULL REFERENCES commands(id),
+        directory_id INTEGER NOT NULL REFERENCES directories(id),
+        count INTEGER NOT NULL,
+        PRIMARY KEY (command_id, directory_id)
+    ) WITHOUT ROWID;
+)sql";
+
+// aggregated from events in one pass instead of replaying update_stats, so
+// the migration does not depend on columns added by later versions
+constexpr auto sql_v2_aggregate_stats = R"sql(
+    INSERT INTO command_stats
+        (command_id, count, success_count, last_time, score)
+    SELECT command_id, count(*), total(return_code = 0), max(time),
+           logsumexp(run_score(return_code, time))
+    FROM events GROUP BY command_id;
+
+    INSERT INTO command_directory_stats (command_id, directory_id, count)
+    SELECT command_id, directory_id, count(*) FROM events
+    WHERE directory_id IS NOT NULL GROUP BY command_id, directory_id;
+)sql";
+
+// every select path reads either the stats tables or a covering index, so
+// listing never touches the events table rows
+constexpr auto sql_v3_covering_indexes = R"sql(
+    DROP INDEX idx_filter;
+    CREATE INDEX idx_filter
+    ON events(return_code, directory_id, time, command_id);
+
+    CREATE INDEX idx_events_command
+    ON events(command_id, directory_id, return_code, time);
+
+    ALTER TABLE command_stats ADD COLUMN last_success_time INTEGER;
+
+    UPDATE command_stats SET last_success_time = (
+        SELECT max(time) FROM events
+        WHERE events.command_id = command_stats.command_id
+        AND return_code = 0
+    );
+
+    CREATE INDEX idx_command_stats_last_time ON command_stats(last_time);
+    CREATE INDEX idx_command_stats_last_success_time
+    ON command_stats(last_success_time);
+)sql";
+
+// retention drops the oldest events first
+constexpr auto sql_v4_time_index = R"sql(
+    CREATE INDEX idx_events_time ON events(time);
+)sql";
+
+// aggregates for zhist stats. failures of runs that were folded into one
+// event can't be told apart any more, so each failed event counts once
+constexpr auto sql_v5_report_stats = R"sql(
+    ALTER TABLE command_stats
+    ADD COLUMN failure_count INTEGER NOT NULL DEFAULT 0;
+
+    UPDATE command_stats SET failure_count = (
+        SELECT count(*) FROM events
+        WHERE events.command_id = command_stats.command_id
+        AND return_code != 0
+    );
+
+    CREATE INDEX idx_command_stats_count ON command_stats(count);
+    CREATE INDEX idx_command_stats_failure_count
+    ON command_stats(failure_count) WHERE failure_count > 0;
+
+    CREATE TABLE directory_stats (
+        directory_id INTEGER PRIMARY KEY REFERENCES directories(id),
+        count INTEGER NOT NULL
+    );
+
+    INSERT INTO directory_stats (directory_id, count)
+    SELECT directory_id, sum(count) FROM command_directory_stats
+    GROUP BY directory_id;
+
+    CREATE INDEX idx_directory_stats_count ON directory_stats(count);
+
+    CREATE TABLE activity_stats (
+        hour INTEGER PRIMARY KEY,
+        count INTEGER NOT NULL
+    );
+
+    INSERT INTO activity_stats (hour, count)
+    SELECT time / 3600000, count(*) FROM events WHERE time IS NOT NULL
+    GROUP BY 1;
+)sql";
+
+// durations are only known for runs added since, and are kept per command
+// and UTC day as a sketch so that percentiles never need the events
+constexpr auto sql_v6_durations = R"sql(
+    ALTER TABLE events ADD COLUMN duration_ms INTEGER;
+
+    CREATE TABLE duration_sketches (
+        day INTEGER NOT NULL,
+        command_id INTEGER NOT NULL REFERENCES commands(id),
+        sketch BLOB NOT NULL,
+        PRIMARY KEY (day, command_id)
+    ) WITHOUT ROWID;
+
+    CREATE INDEX idx_duration_sketches_command_id
+    ON duration_sketches(command_id);
+)sql";
+
+namespace {
+
+struct Migration {
+    const char* description;
+    void (*apply)(sql::Session& session, const sql::MigrationProgress& report);
+};
+
+void migrate_v1(sql::Session& session,
+                const sql::MigrationProgress& /*report*/) {
+    session.exec(sql_v1_schema);
+}
+
+void migrate_v2(sql::Session& session, const sql::MigrationProgress& report) {
+    report("copying commands and directories");
+    session.exec(sql_v2_create_tables);
+    session.exec(sql_v2_copy_commands);
+    session.exec(sql_v2_copy_directories);
+
+    report("copying history");
+    session.exec(sql_v2_copy_events);
+    session.exec(sql_v2_drop_histories);
+    session.exec(sql_v2_create_views);
+
+    report("building search index");
+    session.exec(sql_v2_create_search);
+
+    report("aggregating stats");
+    session.exec(sql_v2_create_stats);
+    session.exec(sql_v2_aggregate_stats);
+}
+
+void migrate_v3(sql::Session& session,
+                const sql::MigrationProgress& /*report*/) {
+    session.exec(sql_v3_covering_indexes);
+}
+
+void migrate_v4(sql::Session& session,
+                const sql::MigrationProgress& /*report*/) {
+    session.exec(sql_v4_time_index);
+}
+
+void migrate_v5(sql::Session& session,
+                const sql::MigrationProgress& /*report*/) {
+    session.exec(sql_v5_report_stats);
+}
+
+void migrate_v6(sql::Session& session,
+                const sql::MigrationProgress& /*report*/) {
+    session.exec(sql_v6_durations);
+}
+
+// migrations[i] upgrades a database from version i to version i + 1
+const std::array<Migration, sql::schema_version> migrations = {{
+    {.description = "create histories", .apply = migrate_v1},
+    {.description = "intern commands and directories", .apply = migrate_v2},
+    {.description = "add covering indexes", .apply = migrate_v3},
+    {.description = "index events by time", .apply = migrate_v4},
+    {.description = "aggregate stats for reports", .apply = migrate_v5},
+    {.description = "record durations", .apply = migrate_v6},
+}};
+
+}  // namespace
+
+namespace sql {
+
+int get_schema_version(Session& session) {
+    auto stmt = session.prepare(sql_get_user_version);
+    return sqlite3_step(stmt.get()) == SQLITE_ROW
+               ? sqlite3_column_int(stmt.get(), 0)
+               : 0;
+}
+
+void migrate(Session& session, const MigrationProgress& report) {
+    auto version = get_schema_version(session);
+    if (version > schema_version) {
+        throw std::runtime_error("database schema v" + std::to_string(version) +
+                                 " is newer than this zhist supports");
+    }
+    if (version == schema_version) {
+        return;
+    }
+
+    Transaction transaction(session);
+
+    for (; version < schema_version; ++version) {
+        const auto& migration = migrations.at(version);
+        report("v" + std::to_string(version + 1) + ": " +
+               migration.description);
+        migration.apply(session, report);
+    }
+
+    auto set_version = "PRAGMA user_version = " + std::to_string(version);
+    session.exec(set_version.c_str());
+
+    transaction.commit();
+}
+
+}  // namespace sql
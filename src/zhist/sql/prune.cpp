@@ -0,0 +1,252 @@
+#include "zhist.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+
+#include <sqlite3.h>
+
+constexpr auto sql_get_auto_vacuum = R"sql(
+    PRAGMA auto_vacuum
+)sql";
+
+// auto_vacuum only changes on an empty database or with a VACUUM
+constexpr auto sql_enable_incremental_vacuum = R"sql(
+    PRAGMA auto_vacuum = INCREMENTAL;
+    VACUUM;
+)sql";
+
+constexpr auto sql_get_freelist_count = R"sql(
+    PRAGMA freelist_count
+)sql";
+
+// a checkpoint that finds readers in the way reports it in its result row
+// instead of failing
+constexpr auto sql_checkpoint = R"sql(
+    PRAGMA wal_checkpoint(TRUNCATE)
+)sql";
+
+// deleted commands leave tombstones in the search index until its segments
+// are merged, which this does a bounded amount of at a time
+constexpr auto sql_merge_search = R"sql(
+    INSERT INTO commands_fts (commands_fts, rank) VALUES ('merge', ?)
+)sql";
+
+// candidates keep the time they had when they were marked, so an event
+// that is run again before the batch reaches it survives
+constexpr auto sql_create_expired = R"sql(
+    CREATE TEMP TABLE IF NOT EXISTS expired (
+        id INTEGER PRIMARY KEY,
+        time INTEGER
+    );
+    DELETE FROM temp.expired;
+)sql";
+
+constexpr auto sql_mark_older = R"sql(
+    INSERT OR IGNORE INTO temp.expired (id, time)
+    SELECT id, time FROM events WHERE time < ?
+)sql";
+
+// untimed events, from history loaded without timestamps, go first
+constexpr auto sql_mark_beyond_rows = R"sql(
+    INSERT OR IGNORE INTO temp.expired (id, time)
+    SELECT id, time FROM events
+    ORDER BY time DESC, id DESC
+    LIMIT -1 OFFSET ?
+)sql";
+
+constexpr auto sql_mark_beyond_per_command = R"sql(
+    INSERT OR IGNORE INTO temp.expired (id, time)
+    SELECT id, time FROM (
+        SELECT id, time, row_number() OVER (
+            PARTITION BY command_id ORDER BY time DESC, id DESC
+        ) AS n
+        FROM events
+    )
+    WHERE n > ?
+)sql";
+
+constexpr auto sql_count_expired = R"sql(
+    SELECT count(*) FROM temp.expired
+)sql";
+
+constexpr auto sql_delete_expired = R"sql(
+    DELETE FROM events
+    WHERE id IN (SELECT id FROM temp.expired ORDER BY id LIMIT ?1)
+      AND time IS (SELECT time FROM temp.expired AS x WHERE x.id = events.id)
+    RETURNING command_id, directory_id
+)sql";
+
+constexpr auto sql_unmark_expired = R"sql(
+    DELETE FROM temp.expired
+    WHERE id IN (SELECT id FROM temp.expired ORDER BY id LIMIT ?1)
+)sql";
+
+constexpr auto sql_delete_directory_stats = R"sql(
+    DELETE FROM command_directory_stats
+    WHERE command_id = ?1 AND directory_id = ?2
+      AND NOT EXISTS (
+        SELECT 1 FROM events WHERE command_id = ?1 AND directory_id = ?2
+      )
+)sql";
+
+// counts and scores sum up every run ever added and are left as they are,
+// but the times have to point at events that still exist
+constexpr auto sql_update_stats_times = R"sql(
+    UPDATE command_stats SET
+        last_time = (SELECT max(time) FROM events WHERE command_id = ?1),
+        last_success_time = (
+            SELECT max(time) FROM events
+            WHERE command_id = ?1 AND return_code = 0
+        )
+    WHERE command_id = ?1
+)sql";
+
+constexpr auto sql_delete_unused_command = R"sql(
+    DELETE FROM command_stats WHERE command_id = ?1
+      AND NOT EXISTS (SELECT 1 FROM events WHERE command_id = ?1)
+)sql";
+
+constexpr auto sql_delete_unused_durations = R"sql(
+    DELETE FROM duration_sketches WHERE command_id = ?1
+      AND NOT EXISTS (SELECT 1 FROM events WHERE command_id = ?1)
+)sql";
+
+constexpr auto sql_delete_unused_command_text = R"sql(
+    DELETE FROM commands WHERE id = ?1
+      AND NOT EXISTS (SELECT 1 FROM events WHERE command_id = ?1)
+)sql";
+
+namespace {
+
+constexpr int64_t ms_per_day = 24 * 60 * 60 * 1000;
+
+int64_t get_int(sql::Session& session, const char* sql) {
+    auto stmt = session.prepare(sql);
+    return session.step(stmt) == SQLITE_ROW
+               ? sqlite3_column_int64(stmt.get(), 0)
+               : 0;
+}
+
+void mark(sql::Session& session, const char* sql, int64_t value) {
+    auto stmt = session.prepare(sql);
+    sqlite3_bind_int64(stmt.get(), 1, value);
+    session.step(stmt);
+}
+
+void run_for(sql::Session& session, const char* sql, int64_t command_id,
+             std::optional<int64_t> directory_id = std::nullopt) {
+    auto stmt = session.prepare(sql);
+    sqlite3_bind_int64(stmt.get(), 1, command_id);
+    if (directory_id) {
+        sqlite3_bind_int64(stmt.get(), 2, *directory_id);
+    }
+    session.step(stmt);
+}
+
+}  // namespace
+
+namespace sql {
+
+bool has_incremental_vacuum(Session& session) {
+    constexpr int incremental = 2;
+    return get_int(session, sql_get_auto_vacuum) == incremental;
+}
+
+void enable_incremental_vacuum(Session& session) {
+    session.exec(sql_enable_incremental_vacuum);
+}
+
+bool incremental_vacuum(Session& session, int num_pages) {
+    auto before = get_int(session, sql_get_freelist_count);
+
+    // pragmas take no parameters
+    auto vacuum =
+        "PRAGMA incremental_vacuum(" + std::to_string(num_pages) + ")";
+    session.exec(vacuum.c_str());
+
+    auto after = get_int(session, sql_get_freelist_count);
+    return after > 0 && after < before;
+}
+
+bool merge_search_index(Session& session, int num_pages) {
+    auto changes = sqlite3_total_changes64(session.get());
+    {
+        auto stmt = session.prepare(sql_merge_search);
+        // a negative count merges segments on any level, not only full
+        // ones, which is what clears the tombstones
+        sqlite3_bind_int(stmt.get(), 1, -num_pages);
+        session.step(stmt);
+    }
+    // the insert itself counts as one change
+    return sqlite3_total_changes64(session.get()) - changes > 1;
+}
+
+void checkpoint(Session& session) {
+    session.exec(sql_checkpoint);
+}
+
+std::size_t mark_expired(Session& session, const Retention& retention,
+                         int64_t now) {
+    session.exec(sql_create_expired);
+
+    if (retention.max_age_days) {
+        mark(session, sql_mark_older,
+             now - *retention.max_age_days * ms_per_day);
+    }
+    if (retention.max_rows) {
+        mark(session, sql_mark_beyond_rows, *retention.max_rows);
+    }
+    if (retention.max_per_command) {
+        mark(session, sql_mark_beyond_per_command, *retention.max_per_command);
+    }
+
+    return static_cast<std::size_t>(get_int(session, sql_count_expired));
+}
+
+PruneCounts prune(Session& session, int limit) {
+    PruneCounts counts = {.num_events = 0, .num_commands = 0};
+
+    std::set<std::pair<int64_t, std::optional<int64_t>>> touched;
+    {
+        auto stmt = session.prepare(sql_delete_expired);
+        sqlite3_bind_int(stmt.get(), 1, limit);
+        while (session.step(stmt) == SQLITE_ROW) {
+            std::optional<int64_t> directory_id;
+            if (sqlite3_column_type(stmt.get(), 1) != SQLITE_NULL) {
+                directory_id = sqlite3_column_int64(stmt.get(), 1);
+            }
+            touched.emplace(sqlite3_column_int64(stmt.get(), 0), directory_id);
+            ++counts.num_events;
+        }
+    }
+
+    {
+        auto stmt = session.prepare(sql_unmark_expired);
+        sqlite3_bind_int(stmt.get(), 1, limit);
+        session.step(stmt);
+    }
+
+    std::set<int64_t> command_ids;
+    for (const auto& [command_id, directory_id] : touched) {
+        if (directory_id) {
+            run_for(session, sql_delete_directory_stats, command_id,
+                    directory_id);
+        }
+        command_ids.insert(command_id);
+    }
+
+    for (auto command_id : command_ids) {
+        run_for(session, sql_update_stats_times, command_id);
+        run_for(session, sql_delete_unused_command, command_id);
+        run_for(session, sql_delete_unused_durations, command_id);
+        run_for(session, sql_delete_unused_command_text, command_id);
+        counts.num_commands += sqlite3_changes(session.get());
+    }
+
+    return counts;
+}
+
+}  // namespace sql
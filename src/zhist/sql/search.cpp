@@ -0,0 +1,86 @@
+#include "zhist.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+#include <sqlite3.h>
+
+namespace fs = std::filesystem;
+
+using ms = std::chrono::milliseconds;
+using std::chrono::duration_cast;
+
+// each run scores less the older it is, and less again when it failed or
+// happened outside the current directory
+constexpr auto sql_search = R"sql(
+    SELECT c.command FROM commands_fts AS f
+    JOIN commands AS c ON c.id = f.rowid
+    JOIN events AS e ON e.command_id = c.id
+    WHERE f.command LIKE ?1
+    GROUP BY c.id
+    ORDER BY sum(
+        (CASE WHEN e.return_code = 0 THEN 1.0 ELSE 0.25 END) *
+        (CASE WHEN e.directory_id = (
+            SELECT id FROM directories WHERE directory = ?2
+        ) THEN 2.0 ELSE 1.0 END) /
+        (1.0 + (?3 - coalesce(e.time, 0)) / 86400000.0)
+    ) DESC
+    LIMIT ?4
+)sql";
+
+namespace {
+
+// "git  co" becomes "%git%co%"
+std::string make_pattern(std::string_view query) {
+    constexpr auto whitespace = " \t\n\v\f\r";
+
+    std::string pattern = "%";
+    while (true) {
+        auto begin = query.find_first_not_of(whitespace);
+        if (begin == std::string_view::npos) {
+            break;
+        }
+        query.remove_prefix(begin);
+
+        auto end = query.find_first_of(whitespace);
+        pattern.append(query.substr(0, end));
+        pattern.push_back('%');
+
+        if (end == std::string_view::npos) {
+            break;
+        }
+        query.remove_prefix(end);
+    }
+    return pattern;
+}
+
+}  // namespace
+
+namespace sql {
+
+void search(Session& session, std::string_view query, const fs::path& cwd_path,
+            int limit, const CommandVisitor& f) {
+    auto stmt = session.prepare(sql_search);
+
+    auto now = std::chrono::system_clock::now();
+    auto time = duration_cast<ms>(now.time_since_epoch()).count();
+
+    auto pattern = make_pattern(query);
+    const auto& dir = cwd_path.native();
+
+    sqlite3_bind_text(stmt.get(), 1, pattern.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt.get(), 2, dir.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt.get(), 3, time);
+    sqlite3_bind_int(stmt.get(), 4, limit);
+
+    while (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+        const auto* txt = sqlite3_column_text(stmt.get(), 0);
+        auto len = sqlite3_column_bytes(stmt.get(), 0);
+        f(std::string_view(reinterpret_cast<const char*>(txt), len));
+    }
+}
+
+}  // namespace sql
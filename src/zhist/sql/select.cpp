@@ -2,98 +2,180 @@
 
 #include <filesystem>
 #include <string>
-#include <vector>
+#include <string_view>
 
 #include <sqlite3.h>
 
 namespace fs = std::filesystem;
 
+// walks idx_command_stats_last_time instead of grouping every event
 constexpr auto sql_select_all = R"sql(
-    SELECT DISTINCT command FROM histories
-    ORDER BY time ASC
+    SELECT c.command, s.last_time FROM command_stats AS s
+    JOIN commands AS c ON c.id = s.command_id
+    ORDER BY s.last_time DESC
 )sql";
 
 constexpr auto sql_select_success = R"sql(
-    SELECT command FROM histories
-    WHERE return_code = 0 AND directory = ?
-    ORDER BY time ASC
+    SELECT c.command, e.time FROM events AS e
+    JOIN commands AS c ON c.id = e.command_id
+    WHERE e.return_code = 0
+      AND e.directory_id = (SELECT id FROM directories WHERE directory = ?)
+    ORDER BY e.time DESC
 )sql";
 
 constexpr auto sql_select_recent = R"sql(
-    SELECT DISTINCT command FROM histories
-    WHERE return_code = 0
-    ORDER BY time DESC
-    LIMIT ?;
+    SELECT c.command, r.last_success_time FROM (
+        SELECT command_id, last_success_time FROM command_stats
+        WHERE last_success_time IS NOT NULL
+        ORDER BY last_success_time DESC
+        LIMIT ?
+    ) AS r
+    JOIN commands AS c ON c.id = r.command_id
+    ORDER BY r.last_success_time ASC
 )sql";
 
-namespace sql {
+// the best scores overall, with a bonus of about log(4), so four times the
+// weight, for commands that have been run in the current directory
+constexpr auto sql_select_frecency = R"sql(
+    SELECT
+        c.command,
+        s.score + (CASE WHEN d.count IS NULL THEN 0 ELSE 1.4 END) AS rank
+    FROM (
+        SELECT command_id, score FROM command_stats
+        ORDER BY score DESC
+        LIMIT ?2
+    ) AS s
+    JOIN commands AS c ON c.id = s.command_id
+    LEFT JOIN command_directory_stats AS d
+    ON d.command_id = s.command_id
+      AND d.directory_id = (SELECT id FROM directories WHERE directory = ?1)
+    ORDER BY rank DESC
+)sql";
 
-std::vector<std::string> select(sqlite3* db) {
-    sqlite3_stmt* stmt = nullptr;
-    int rc = sqlite3_prepare_v2(db, sql_select_all, -1, &stmt, nullptr);
-    if (rc != SQLITE_OK) {
-        return {};
-    }
+// the directory and the range of its descendants, ?2 <= d < ?3, are found
+// on the unique index of directories, and their successful runs on
+// idx_filter. the cross join keeps the planner from scanning every
+// successful run instead. a command ranks by the nearest level it was run
+// on, then by its latest run in the subtree. each level lowers the rank by
+// 1e13 ms, about 300 years, so no time can lift a command above a nearer
+// one
+constexpr auto sql_select_subtree = R"sql(
+    WITH subtree AS (
+        SELECT id, CASE WHEN directory = ?1 THEN 0 ELSE
+            1 + length(substr(directory, length(?2) + 1))
+              - length(replace(substr(directory, length(?2) + 1), '/', ''))
+        END AS level
+        FROM directories
+        WHERE directory = ?1 OR (directory >= ?2 AND directory < ?3)
+    )
+    SELECT c.command, r.rank FROM (
+        SELECT e.command_id, max(e.time) - min(s.level) * 1e13 AS rank
+        FROM subtree AS s
+        CROSS JOIN events AS e ON e.return_code = 0 AND e.directory_id = s.id
+        GROUP BY e.command_id
+    ) AS r
+    JOIN commands AS c ON c.id = r.command_id
+    ORDER BY r.rank DESC
+)sql";
+
+namespace {
 
-    std::vector<std::string> commands;
+// the second column of every select is the value it is ordered by
+void visit_commands(sqlite3_stmt* stmt, const RankedCommandVisitor& f) {
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         const auto* txt = sqlite3_column_text(stmt, 0);
         if (txt == nullptr) {
             continue;
         }
-        commands.emplace_back(reinterpret_cast<const char*>(txt));
+        auto len = sqlite3_column_bytes(stmt, 0);
+        f(std::string_view(reinterpret_cast<const char*>(txt), len),
+          sqlite3_column_double(stmt, 1));
     }
+}
+
+RankedCommandVisitor unranked(const CommandVisitor& f) {
+    return [&f](std::string_view cmd, double /*rank*/) { f(cmd); };
+}
+
+}  // namespace
 
-    sqlite3_finalize(stmt);
+namespace sql {
+
+void select(Session& session, const RankedCommandVisitor& f) {
+    auto stmt = session.prepare(sql_select_all);
 
-    return commands;
+    visit_commands(stmt.get(), f);
 }
 
-std::vector<std::string> select(sqlite3* db, const fs::path& cwd_path) {
-    sqlite3_stmt* stmt = nullptr;
-    int rc = sqlite3_prepare_v2(db, sql_select_success, -1, &stmt, nullptr);
-    if (rc != SQLITE_OK) {
-        return {};
-    }
+void select(Session& session, const fs::path& cwd_path,
+            const RankedCommandVisitor& f) {
+    auto stmt = session.prepare(sql_select_success);
 
-    std::string dir = cwd_path.string();
-    sqlite3_bind_text(stmt, 1, dir.c_str(), -1, SQLITE_TRANSIENT);
+    const auto& dir = cwd_path.native();
+    sqlite3_bind_text(stmt.get(), 1, dir.c_str(), -1, SQLITE_STATIC);
 
-    std::vector<std::string> commands;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        const auto* txt = sqlite3_column_text(stmt, 0);
-        if (txt == nullptr) {
-            continue;
-        }
-        commands.emplace_back(reinterpret_cast<const char*>(txt));
-    }
+    visit_commands(stmt.get(), f);
+}
+
+void select(Session& session, int limit, const RankedCommandVisitor& f) {
+    auto stmt = session.prepare(sql_select_recent);
 
-    sqlite3_finalize(stmt);
+    sqlite3_bind_int(stmt.get(), 1, limit);
 
-    return commands;
+    visit_commands(stmt.get(), f);
 }
 
-std::vector<std::string> select(sqlite3* db, int limit) {
-    sqlite3_stmt* stmt = nullptr;
-    int rc = sqlite3_prepare_v2(db, sql_select_recent, -1, &stmt, nullptr);
-    if (rc != SQLITE_OK) {
-        return {};
-    }
+void select_frecency(Session& session, const fs::path& cwd_path, int limit,
+                     const RankedCommandVisitor& f) {
+    auto stmt = session.prepare(sql_select_frecency);
 
-    sqlite3_bind_int(stmt, 1, limit);
+    const auto& dir = cwd_path.native();
+    sqlite3_bind_text(stmt.get(), 1, dir.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt.get(), 2, limit);
 
-    std::vector<std::string> commands;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        const auto* txt = sqlite3_column_text(stmt, 0);
-        if (txt == nullptr) {
-            continue;
-        }
-        commands.emplace_back(reinterpret_cast<const char*>(txt));
-    }
+    visit_commands(stmt.get(), f);
+}
+
+void select_subtree(Session& session, const fs::path& cwd_path,
+                    const RankedCommandVisitor& f) {
+    auto stmt = session.prepare(sql_select_subtree);
+
+    // descendants start with dir/ and sort before dir0, as '0' follows '/'
+    const auto& dir = cwd_path.native();
+    auto first = dir.ends_with('/') ? dir : dir + '/';
+    auto last = first.substr(0, first.size() - 1) + '0';
+
+    sqlite3_bind_text(stmt.get(), 1, dir.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt.get(), 2, first.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt.get(), 3, last.c_str(), -1, SQLITE_STATIC);
 
-    sqlite3_finalize(stmt);
+    visit_commands(stmt.get(), f);
+}
+
+void select(Session& session, FilterMode filter_mode, int recent_num,
+            const fs::path& cwd_path, const RankedCommandVisitor& f) {
+    switch (filter_mode) {
+        case FilterMode::All: {
+            select(session, f);
+        } break;
+        case FilterMode::Recent: {
+            select(session, recent_num, f);
+        } break;
+        case FilterMode::CurrentPath: {
+            select(session, cwd_path, f);
+        } break;
+        case FilterMode::Frecency: {
+            select_frecency(session, cwd_path, recent_num, f);
+        } break;
+        case FilterMode::Subtree: {
+            select_subtree(session, cwd_path, f);
+        } break;
+    }
+}
 
-    return commands;
+void select(Session& session, FilterMode filter_mode, int recent_num,
+            const fs::path& cwd_path, const CommandVisitor& f) {
+    select(session, filter_mode, recent_num, cwd_path, unranked(f));
 }
 
 }  // namespace sql
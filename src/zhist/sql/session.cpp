@@ -0,0 +1,326 @@
+#include "zhist.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+#include <sqlite3.h>
+
+namespace fs = std::filesystem;
+
+constexpr auto sql_pragma_wal = R"sql(
+    PRAGMA journal_mode = WAL;
+)sql";
+
+constexpr auto sql_pragma_tuning = R"sql(
+    PRAGMA synchronous = NORMAL;
+    PRAGMA mmap_size = 268435456;
+    PRAGMA cache_size = -16384;
+    PRAGMA temp_store = MEMORY;
+    -- REPLACE has to fire the delete triggers of the search index
+    PRAGMA recursive_triggers = ON;
+)sql";
+
+constexpr auto sql_begin = R"sql(
+    BEGIN IMMEDIATE;
+)sql";
+
+constexpr auto sql_commit = R"sql(
+    COMMIT;
+)sql";
+
+constexpr auto sql_rollback = R"sql(
+    ROLLBACK;
+)sql";
+
+namespace {
+
+// sleeps of up to 1, 2, 4, ... 64 ms, so a writer waits at most about
+// 127 ms before it gives up and leaves its work in the journal
+constexpr int busy_max_retries = 7;
+
+// the sleeps are jittered so that shells woken by the same commit don't
+// all retry at once
+int busy_handler(void* /*arg*/, int count) {
+    if (count >= busy_max_retries) {
+        return 0;
+    }
+
+    thread_local std::minstd_rand rng(getpid());
+    auto max_sleep = std::chrono::microseconds(1000 << count);
+    std::uniform_int_distribution<int64_t> sleep(max_sleep.count() / 2,
+                                                 max_sleep.count());
+    std::this_thread::sleep_for(std::chrono::microseconds(sleep(rng)));
+
+    return 1;
+}
+
+[[noreturn]] void throw_error(sqlite3* db, int rc) {
+    if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+        throw sql::BusyError(sqlite3_errmsg(db));
+    }
+    throw std::runtime_error(sqlite3_errmsg(db));
+}
+
+// log(exp(a) + exp(b)) without overflowing
+double logaddexp(double a, double b) {
+    return std::max(a, b) + std::log1p(std::exp(-std::abs(a - b)));
+}
+
+void logaddexp_func(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv) {
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_value(ctx, argv[1]);
+        return;
+    }
+    if (sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    sqlite3_result_double(ctx, logaddexp(sqlite3_value_double(argv[0]),
+                                         sqlite3_value_double(argv[1])));
+}
+
+struct LogSumExp {
+    bool has_sum;
+    double sum;
+};
+
+void logsumexp_step(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv) {
+    auto* acc = static_cast<LogSumExp*>(
+        sqlite3_aggregate_context(ctx, sizeof(LogSumExp)));
+    if (acc == nullptr || sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        return;
+    }
+
+    // the context is zeroed on the first call
+    double x = sqlite3_value_double(argv[0]);
+    acc->sum = acc->has_sum ? logaddexp(acc->sum, x) : x;
+    acc->has_sum = true;
+}
+
+void logsumexp_final(sqlite3_context* ctx) {
+    auto* acc = static_cast<LogSumExp*>(sqlite3_aggregate_context(ctx, 0));
+    if (acc == nullptr || !acc->has_sum) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    sqlite3_result_double(ctx, acc->sum);
+}
+
+template <typename T>
+std::optional<T> value(sqlite3_value* v) {
+    if (sqlite3_value_type(v) == SQLITE_NULL) {
+        return std::nullopt;
+    }
+    return static_cast<T>(sqlite3_value_int64(v));
+}
+
+void run_score_func(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv) {
+    sqlite3_result_double(
+        ctx, sql::run_score(value<int>(argv[0]), value<int64_t>(argv[1])));
+}
+
+std::optional<DurationSketch> sketch_value(sqlite3_context* ctx,
+                                           sqlite3_value* v) {
+    if (sqlite3_value_type(v) == SQLITE_NULL) {
+        return DurationSketch();
+    }
+
+    const auto* data = static_cast<const char*>(sqlite3_value_blob(v));
+    try {
+        return DurationSketch::decode(std::string_view(
+            data != nullptr ? data : "", sqlite3_value_bytes(v)));
+    } catch (const std::exception& e) {
+        sqlite3_result_error(ctx, e.what(), -1);
+        return std::nullopt;
+    }
+}
+
+void sketch_result(sqlite3_context* ctx, const DurationSketch& sketch) {
+    auto data = sketch.encode();
+    sqlite3_result_blob64(ctx, data.data(), data.size(), SQLITE_TRANSIENT);
+}
+
+// sketch_add(sketch, ms) returns the sketch, or a new one when it is NULL,
+// with one more duration
+void sketch_add_func(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv) {
+    auto sketch = sketch_value(ctx, argv[0]);
+    if (!sketch) {
+        return;
+    }
+    if (sqlite3_value_type(argv[1]) != SQLITE_NULL) {
+        sketch->add(sqlite3_value_int64(argv[1]));
+    }
+    sketch_result(ctx, *sketch);
+}
+
+// the aggregate context holds a pointer to the merged sketch, which the
+// final call frees
+void sketch_merge_step(sqlite3_context* ctx, int /*argc*/,
+                       sqlite3_value** argv) {
+    auto** acc = static_cast<DurationSketch**>(
+        sqlite3_aggregate_context(ctx, sizeof(DurationSketch*)));
+    if (acc == nullptr || sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        return;
+    }
+
+    auto sketch = sketch_value(ctx, argv[0]);
+    if (!sketch) {
+        return;
+    }
+    if (*acc == nullptr) {
+        *acc = new DurationSketch(std::move(*sketch));
+    } else {
+        (*acc)->merge(*sketch);
+    }
+}
+
+void sketch_merge_final(sqlite3_context* ctx) {
+    auto** acc =
+        static_cast<DurationSketch**>(sqlite3_aggregate_context(ctx, 0));
+    if (acc == nullptr || *acc == nullptr) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    sketch_result(ctx, **acc);
+    delete *acc;
+}
+
+void sketch_quantile_func(sqlite3_context* ctx, int /*argc*/,
+                          sqlite3_value** argv) {
+    auto sketch = sketch_value(ctx, argv[0]);
+    if (!sketch) {
+        return;
+    }
+    if (auto q = sketch->quantile(sqlite3_value_double(argv[1]))) {
+        sqlite3_result_double(ctx, *q);
+    } else {
+        sqlite3_result_null(ctx);
+    }
+}
+
+void sketch_count_func(sqlite3_context* ctx, int /*argc*/,
+                       sqlite3_value** argv) {
+    if (auto sketch = sketch_value(ctx, argv[0])) {
+        sqlite3_result_int64(ctx, static_cast<int64_t>(sketch->count()));
+    }
+}
+
+void register_functions(sqlite3* db) {
+    constexpr int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+
+    sqlite3_create_function_v2(db, "logaddexp", 2, flags, nullptr,
+                               logaddexp_func, nullptr, nullptr, nullptr);
+    sqlite3_create_function_v2(db, "logsumexp", 1, flags, nullptr, nullptr,
+                               logsumexp_step, logsumexp_final, nullptr);
+    sqlite3_create_function_v2(db, "run_score", 2, flags, nullptr,
+                               run_score_func, nullptr, nullptr, nullptr);
+    sqlite3_create_function_v2(db, "sketch_add", 2, flags, nullptr,
+                               sketch_add_func, nullptr, nullptr, nullptr);
+    sqlite3_create_function_v2(db, "sketch_merge", 1, flags, nullptr, nullptr,
+                               sketch_merge_step, sketch_merge_final, nullptr);
+    sqlite3_create_function_v2(db, "sketch_quantile", 2, flags, nullptr,
+                               sketch_quantile_func, nullptr, nullptr,
+                               nullptr);
+    sqlite3_create_function_v2(db, "sketch_count", 1, flags, nullptr,
+                               sketch_count_func, nullptr, nullptr, nullptr);
+}
+
+}  // namespace
+
+namespace sql {
+
+Session::Session(const fs::path& db_path, int flags) {
+    int rc = sqlite3_open_v2(db_path.c_str(), &db_, flags, nullptr);
+    if (rc != SQLITE_OK) {
+        std::string msg = "Can't open database: ";
+        msg += sqlite3_errmsg(db_);
+        sqlite3_close(db_);
+        throw std::runtime_error(msg);
+    }
+
+    register_functions(db_);
+    sqlite3_busy_handler(db_, busy_handler, nullptr);
+
+    // the destructor doesn't run when the constructor throws, say when
+    // switching to WAL finds the database busy
+    try {
+        if ((flags & SQLITE_OPEN_READWRITE) != 0) {
+            exec(sql_pragma_wal);
+        }
+        exec(sql_pragma_tuning);
+    } catch (...) {
+        sqlite3_close(db_);
+        throw;
+    }
+}
+
+Session::~Session() {
+    for (auto& [_, stmt] : stmts_) {
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(db_);
+}
+
+Statement Session::prepare(const char* sql) {
+    auto it = stmts_.find(sql);
+    if (it != stmts_.end()) {
+        return Statement(it->second);
+    }
+
+    sqlite3_stmt* stmt = nullptr;
+    int rc = sqlite3_prepare_v3(db_, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt,
+                                nullptr);
+    if (rc != SQLITE_OK) {
+        throw std::runtime_error(sqlite3_errmsg(db_));
+    }
+
+    stmts_.emplace(sql, stmt);
+
+    return Statement(stmt);
+}
+
+void Session::exec(const char* sql) {
+    int rc = sqlite3_exec(db_, sql, nullptr, nullptr, nullptr);
+    if (rc != SQLITE_OK) {
+        throw_error(db_, rc);
+    }
+}
+
+int Session::step(const Statement& stmt) {
+    int rc = sqlite3_step(stmt.get());
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        throw_error(db_, rc);
+    }
+    return rc;
+}
+
+Transaction::Transaction(Session& session) : session_(session) {
+    session_.exec(sql_begin);
+}
+
+Transaction::~Transaction() {
+    if (!committed_) {
+        sqlite3_exec(session_.get(), sql_rollback, nullptr, nullptr, nullptr);
+    }
+}
+
+void Transaction::commit() {
+    session_.exec(sql_commit);
+    committed_ = true;
+}
+
+}  // namespace sql
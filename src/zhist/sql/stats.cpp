@@ -0,0 +1,336 @@
+#include "zhist.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <sqlite3.h>
+
+constexpr auto sql_upsert_command_stats = R"sql(
+    INSERT INTO command_stats (
+        command_id, count, success_count, failure_count, last_time,
+        last_success_time, score
+    )
+    VALUES (
+        ?1, 1, ?2 IS 0, coalesce(?2 != 0, 0), ?3,
+        CASE WHEN ?2 IS 0 THEN ?3 END, run_score(?2, ?3)
+    )
+    ON CONFLICT (command_id) DO UPDATE SET
+        count = count + 1,
+        success_count = success_count + excluded.success_count,
+        failure_count = failure_count + excluded.failure_count,
+        last_time = coalesce(max(last_time, excluded.last_time), last_time,
+                             excluded.last_time),
+        last_success_time = coalesce(
+            max(last_success_time, excluded.last_success_time),
+            last_success_time, excluded.last_success_time),
+        score = logaddexp(score, excluded.score)
+)sql";
+
+constexpr auto sql_upsert_command_directory_stats = R"sql(
+    INSERT INTO command_directory_stats (command_id, directory_id, count)
+    VALUES (?, ?, 1)
+    ON CONFLICT (command_id, directory_id) DO UPDATE SET count = count + 1
+)sql";
+
+constexpr auto sql_upsert_directory_stats = R"sql(
+    INSERT INTO directory_stats (directory_id, count) VALUES (?, 1)
+    ON CONFLICT (directory_id) DO UPDATE SET count = count + 1
+)sql";
+
+// runs per hour since the epoch, so any time zone can be shown
+constexpr auto sql_upsert_activity_stats = R"sql(
+    INSERT INTO activity_stats (hour, count) VALUES (? / 3600000, 1)
+    ON CONFLICT (hour) DO UPDATE SET count = count + 1
+)sql";
+
+constexpr auto sql_upsert_duration_sketch = R"sql(
+    INSERT INTO duration_sketches (day, command_id, sketch)
+    VALUES (?1 / 86400000, ?2, sketch_add(NULL, ?3))
+    ON CONFLICT (day, command_id) DO UPDATE SET
+        sketch = sketch_add(sketch, ?3)
+)sql";
+
+// the sketches of each window are merged first, so the quantiles are
+// those of all the runs in it rather than an average of daily ones
+constexpr auto sql_select_slow = R"sql(
+    WITH windows AS (
+        SELECT
+            command_id,
+            sketch_merge(sketch) FILTER (WHERE day < ?2) AS baseline,
+            sketch_merge(sketch) FILTER (WHERE day >= ?2) AS recent
+        FROM duration_sketches
+        WHERE day >= ?1
+        GROUP BY command_id
+    ),
+    quantiles AS (
+        SELECT
+            command_id,
+            sketch_count(baseline) AS baseline_count,
+            sketch_quantile(baseline, 0.5) AS baseline_p50,
+            sketch_quantile(baseline, 0.95) AS baseline_p95,
+            sketch_count(recent) AS recent_count,
+            sketch_quantile(recent, 0.5) AS recent_p50,
+            sketch_quantile(recent, 0.95) AS recent_p95
+        FROM windows
+    )
+    SELECT
+        c.command, q.baseline_count, q.baseline_p50, q.baseline_p95,
+        q.recent_count, q.recent_p50, q.recent_p95
+    FROM quantiles AS q
+    JOIN commands AS c ON c.id = q.command_id
+    WHERE q.baseline_count >= ?3 AND q.recent_count >= ?3
+      AND ((q.recent_p50 > q.baseline_p50 * ?4
+            AND q.recent_p50 > q.baseline_p50 + ?5)
+           OR (q.recent_p95 > q.baseline_p95 * ?4
+               AND q.recent_p95 > q.baseline_p95 + ?5))
+    ORDER BY q.recent_p95 / max(q.baseline_p95, 1) DESC,
+             q.recent_p50 / max(q.baseline_p50, 1) DESC
+    LIMIT ?6
+)sql";
+
+constexpr auto sql_select_totals = R"sql(
+    SELECT count(*), total(count) FROM command_stats
+)sql";
+
+constexpr auto sql_count_directories = R"sql(
+    SELECT count(*) FROM directory_stats
+)sql";
+
+constexpr auto sql_select_top_commands = R"sql(
+    SELECT c.command, s.count FROM command_stats AS s
+    JOIN commands AS c ON c.id = s.command_id
+    ORDER BY s.count DESC
+    LIMIT ?
+)sql";
+
+constexpr auto sql_select_top_directories = R"sql(
+    SELECT d.directory, s.count FROM directory_stats AS s
+    JOIN directories AS d ON d.id = s.directory_id
+    ORDER BY s.count DESC
+    LIMIT ?
+)sql";
+
+constexpr auto sql_select_failing_commands = R"sql(
+    SELECT c.command, s.failure_count, s.success_count + s.failure_count
+    FROM command_stats AS s
+    JOIN commands AS c ON c.id = s.command_id
+    WHERE s.failure_count > 0
+    ORDER BY s.failure_count DESC
+    LIMIT ?
+)sql";
+
+constexpr auto sql_select_activity = R"sql(
+    SELECT hour, count FROM activity_stats ORDER BY hour
+)sql";
+
+constexpr auto sql_get_page_size = R"sql(
+    PRAGMA page_size
+)sql";
+
+constexpr auto sql_get_page_count = R"sql(
+    PRAGMA page_count
+)sql";
+
+constexpr auto sql_get_freelist_count = R"sql(
+    PRAGMA freelist_count
+)sql";
+
+namespace {
+
+constexpr double half_life_ms = 7.0 * 24 * 60 * 60 * 1000;
+
+constexpr int64_t day_ms = 24 * 60 * 60 * 1000;
+
+// a change within the error of the sketches, or one of a few ms that
+// rounding to whole ms can make up, is not a slowdown
+constexpr double min_slowdown = 1 + 0.05;
+constexpr double min_slowdown_ms = 10;
+
+int64_t get_int(sql::Session& session, const char* sql) {
+    auto stmt = session.prepare(sql);
+    return sqlite3_step(stmt.get()) == SQLITE_ROW
+               ? sqlite3_column_int64(stmt.get(), 0)
+               : 0;
+}
+
+std::string get_text(sqlite3_stmt* stmt, int col) {
+    const auto* text =
+        reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
+    return text != nullptr
+               ? std::string(text, sqlite3_column_bytes(stmt, col))
+               : std::string();
+}
+
+std::vector<sql::Report::Count> get_counts(sql::Session& session,
+                                           const char* sql, int limit) {
+    std::vector<sql::Report::Count> counts;
+
+    auto stmt = session.prepare(sql);
+    sqlite3_bind_int(stmt.get(), 1, limit);
+    while (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+        counts.push_back({
+            .text = get_text(stmt.get(), 0),
+            .count = sqlite3_column_int64(stmt.get(), 1),
+        });
+    }
+    return counts;
+}
+
+}  // namespace
+
+namespace sql {
+
+// the weight of a run halves every week. scores are kept as
+// log(sum(weight * 2^(time / half_life))), so they grow with new runs
+// instead of decaying and the order of commands never goes stale
+double run_score(std::optional<int> code, std::optional<int64_t> time) {
+    constexpr double weight_success = 1.0;
+    constexpr double weight_unknown = 0.5;
+    constexpr double weight_failure = 0.25;
+
+    double weight = !code        ? weight_unknown
+                    : *code == 0 ? weight_success
+                                 : weight_failure;
+
+    auto half_lives = static_cast<double>(time.value_or(0)) / half_life_ms;
+
+    return std::log(weight) + std::numbers::ln2 * half_lives;
+}
+
+void update_stats(Session& session, int64_t command_id,
+                  std::optional<int64_t> directory_id, std::optional<int> code,
+                  std::optional<int64_t> time) {
+    {
+        auto stmt = session.prepare(sql_upsert_command_stats);
+
+        sqlite3_bind_int64(stmt.get(), 1, command_id);
+        if (code) {
+            sqlite3_bind_int(stmt.get(), 2, *code);
+        }
+        if (time) {
+            sqlite3_bind_int64(stmt.get(), 3, *time);
+        }
+
+        session.step(stmt);
+    }
+
+    if (directory_id) {
+        {
+            auto stmt = session.prepare(sql_upsert_command_directory_stats);
+
+            sqlite3_bind_int64(stmt.get(), 1, command_id);
+            sqlite3_bind_int64(stmt.get(), 2, *directory_id);
+
+            session.step(stmt);
+        }
+        {
+            auto stmt = session.prepare(sql_upsert_directory_stats);
+
+            sqlite3_bind_int64(stmt.get(), 1, *directory_id);
+
+            session.step(stmt);
+        }
+    }
+
+    if (time) {
+        auto stmt = session.prepare(sql_upsert_activity_stats);
+
+        sqlite3_bind_int64(stmt.get(), 1, *time);
+
+        session.step(stmt);
+    }
+}
+
+void record_duration(Session& session, int64_t command_id, int64_t time,
+                     int64_t duration) {
+    auto stmt = session.prepare(sql_upsert_duration_sketch);
+
+    sqlite3_bind_int64(stmt.get(), 1, time);
+    sqlite3_bind_int64(stmt.get(), 2, command_id);
+    sqlite3_bind_int64(stmt.get(), 3, duration);
+
+    session.step(stmt);
+}
+
+// the recent window ends with the current UTC day, and the baseline ends
+// where it starts
+std::vector<SlowCommand> select_slow(Session& session, int64_t now,
+                                     int num_days, int baseline_days,
+                                     int min_runs, int limit) {
+    auto recent_start = now / day_ms - std::max(num_days, 1) + 1;
+    auto baseline_start = recent_start - std::max(baseline_days, 1);
+
+    std::vector<SlowCommand> cmds;
+
+    auto stmt = session.prepare(sql_select_slow);
+    sqlite3_bind_int64(stmt.get(), 1, baseline_start);
+    sqlite3_bind_int64(stmt.get(), 2, recent_start);
+    sqlite3_bind_int(stmt.get(), 3, std::max(min_runs, 1));
+    sqlite3_bind_double(stmt.get(), 4, min_slowdown);
+    sqlite3_bind_double(stmt.get(), 5, min_slowdown_ms);
+    sqlite3_bind_int(stmt.get(), 6, limit);
+    while (session.step(stmt) == SQLITE_ROW) {
+        cmds.push_back({
+            .command = get_text(stmt.get(), 0),
+            .baseline_count = sqlite3_column_int64(stmt.get(), 1),
+            .baseline_p50 = sqlite3_column_double(stmt.get(), 2),
+            .baseline_p95 = sqlite3_column_double(stmt.get(), 3),
+            .recent_count = sqlite3_column_int64(stmt.get(), 4),
+            .recent_p50 = sqlite3_column_double(stmt.get(), 5),
+            .recent_p95 = sqlite3_column_double(stmt.get(), 6),
+        });
+    }
+    return cmds;
+}
+
+// every part is read from the aggregates or walks one of their indexes,
+// so the report takes about as long on a large history as on a small one
+Report report(Session& session, int limit) {
+    Report report = {};
+
+    {
+        auto stmt = session.prepare(sql_select_totals);
+        if (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+            report.num_commands = sqlite3_column_int64(stmt.get(), 0);
+            report.num_runs = sqlite3_column_int64(stmt.get(), 1);
+        }
+    }
+    report.num_directories = get_int(session, sql_count_directories);
+
+    report.top_commands = get_counts(session, sql_select_top_commands, limit);
+    report.top_directories =
+        get_counts(session, sql_select_top_directories, limit);
+
+    {
+        auto stmt = session.prepare(sql_select_failing_commands);
+        sqlite3_bind_int(stmt.get(), 1, limit);
+        while (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+            report.failing_commands.push_back({
+                .command = get_text(stmt.get(), 0),
+                .failure_count = sqlite3_column_int64(stmt.get(), 1),
+                .count = sqlite3_column_int64(stmt.get(), 2),
+            });
+        }
+    }
+
+    {
+        auto stmt = session.prepare(sql_select_activity);
+        while (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+            report.activity.emplace_back(sqlite3_column_int64(stmt.get(), 0),
+                                         sqlite3_column_int64(stmt.get(), 1));
+        }
+    }
+
+    report.page_size = get_int(session, sql_get_page_size);
+    report.page_count = get_int(session, sql_get_page_count);
+    report.freelist_count = get_int(session, sql_get_freelist_count);
+
+    return report;
+}
+
+}  // namespace sql
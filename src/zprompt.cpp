@@ -2,13 +2,43 @@
 
 #include <exception>
 #include <iostream>
+#include <optional>
+#include <string>
 
 #include <argparse/argparse.hpp>
 
 int main(int argc, char* argv[]) {
     argparse::ArgumentParser program("zprompt");
     program.add_description("zsh prompt command");
-    program.add_argument("return_code").help("return code").scan<'i', int>();
+    program.add_argument("return_code")
+        .help("return code")
+        .default_value(0)
+        .nargs(argparse::nargs_pattern::optional)
+        .scan<'i', int>();
+    program.add_argument("--profile")
+        .help("print the time each part of the prompt took to stderr")
+        .default_value(false)
+        .implicit_value(true);
+
+    auto& async_group = program.add_mutually_exclusive_group();
+    async_group.add_argument("--async")
+        .help("use the git status last seen in this directory")
+        .default_value(false)
+        .implicit_value(true);
+    async_group.add_argument("--async-worker")
+        .help(
+            "print the prompt again, NUL-terminated, once the git status is "
+            "known")
+        .default_value(false)
+        .implicit_value(true);
+    async_group.add_argument("--serve")
+        .help("serve prompts on a unix socket")
+        .default_value(false)
+        .implicit_value(true);
+    async_group.add_argument("--client")
+        .help("ask the server for the prompt, making it here if none answers")
+        .default_value(false)
+        .implicit_value(true);
 
     try {
         program.parse_args(argc, argv);
@@ -17,18 +47,75 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    auto config = get_config();
+    if (program.get<bool>("--serve")) {
+        return server::serve();
+    }
+
+    auto context = get_context(program.get<int>("return_code"));
+    auto is_async = program.get<bool>("--async");
+    auto is_async_worker = program.get<bool>("--async-worker");
+    auto profiler = Profiler::from_env(program.get<bool>("--profile"));
+
+    if (program.get<bool>("--client")) {
+        if (auto prompt = profiler.time(
+                "server", [&] { return server::request(context); })) {
+            std::cout << *prompt;
+            profiler.report();
+            return 0;
+        }
+    }
+
+    auto config = profiler.time("config", get_config);
+    auto markers = profiler.time("markers", [&] {
+        return MarkerCache::for_session(config.pwd_markers);
+    });
 
-    auto ret = program.get<int>("return_code");
+    auto print_prompt = [&](const std::string& git_status) {
+        std::cout << format_prompt(config, context, markers, git_status,
+                                   profiler);
+        markers.save();
+    };
+
+    if (!is_async && !is_async_worker) {
+        print_prompt(profiler.time(
+            "git", [&] { return get_git_status(config, context.cwd); }));
+        profiler.report();
+        return 0;
+    }
 
-    auto ssh_status = get_ssh_status(config);
-    auto cwd = get_current_directory(config);
-    auto git_status = get_git_status(config);
-    auto venv_status = get_venv_status(config);
-    auto return_code = get_return_code(config, ret);
+    if (is_async) {
+        async::begin_generation();
+        print_prompt(profiler.time("git-cache", [&] {
+            return async::load_git_status(context.cwd).value_or("");
+        }));
+        profiler.report();
+        return 0;
+    }
+
+    // the prompt this worker is for is the one printed just before it was
+    // started
+    auto generation = async::current_generation();
+    auto is_stale = [&] { return async::current_generation() != generation; };
+
+    auto shown_status = async::load_git_status(context.cwd);
+    auto git_status = profiler.time(
+        "git", [&] { return get_git_status(config, context.cwd, is_stale); });
+    if (!git_status) {
+        return 0;
+    }
+
+    async::save_git_status(context.cwd, *git_status);
+
+    // nothing is printed when the prompt shown is right already, so the
+    // shell has nothing to redraw
+    if (git_status != shown_status && !is_stale()) {
+        print_prompt(*git_status);
+        std::cout << '\0';
+    }
+    profiler.report();
 
-    std::cout << std::format("{}{}{}\n{}{}", ssh_status, cwd, git_status,
-                             venv_status, return_code);
+    // the prompt is complete by now, so this costs it nothing
+    async::prune();
 
     return 0;
 }
@@ -0,0 +1,146 @@
+#include "zprompt.hpp"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <system_error>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// the per-session files of sessions that are gone, and the git segments
+// of directories not visited for this long, are removed. they are only
+// caches, so one still wanted is made again
+constexpr auto max_file_age = std::chrono::days(7);
+
+// how often a worker looks for them, by the time of the stamp file
+constexpr auto prune_interval = std::chrono::days(1);
+
+fs::path generation_path() {
+    return get_runtime_dir() / ("generation-" + std::to_string(getsid(0)));
+}
+
+// the git segment is shared by every session, as it only depends on the
+// directory
+fs::path git_status_path(const fs::path& dir) {
+    return get_runtime_dir() / "git" /
+           std::format("{:016x}", std::hash<std::string>{}(dir.string()));
+}
+
+std::optional<std::string> read_file(const fs::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return std::nullopt;
+    }
+    return std::string(std::istreambuf_iterator<char>(file),
+                       std::istreambuf_iterator<char>());
+}
+
+// written to a new file and renamed over the old one, so a reader never
+// sees half of it
+void write_file(const fs::path& path, const std::string& data) {
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+
+    auto tmp_path = path;
+    tmp_path += ".tmp." + std::to_string(getpid());
+    {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        file << data;
+        if (!file) {
+            fs::remove(tmp_path, ec);
+            return;
+        }
+    }
+    fs::rename(tmp_path, path, ec);
+}
+
+}  // namespace
+
+namespace async {
+
+uint64_t begin_generation() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    auto generation = static_cast<uint64_t>(now.count());
+    write_file(generation_path(), std::to_string(generation));
+    return generation;
+}
+
+std::optional<uint64_t> current_generation() {
+    auto data = read_file(generation_path());
+    if (!data) {
+        return std::nullopt;
+    }
+    try {
+        return std::stoull(*data);
+    } catch (const std::exception&) {
+        return std::nullopt;
+    }
+}
+
+// the file holds the directory on the first line, in case two of them
+// hash the same
+std::optional<std::string> load_git_status(const fs::path& dir) {
+    auto data = read_file(git_status_path(dir));
+    if (!data) {
+        return std::nullopt;
+    }
+
+    auto pos = data->find('\n');
+    if (pos == std::string::npos || data->substr(0, pos) != dir.string()) {
+        return std::nullopt;
+    }
+    return data->substr(pos + 1);
+}
+
+void save_git_status(const fs::path& dir, const std::string& git_status) {
+    write_file(git_status_path(dir), dir.string() + '\n' + git_status);
+}
+
+void prune() {
+    auto dir = get_runtime_dir();
+    auto stamp_path = dir / "pruned";
+    auto now = fs::file_time_type::clock::now();
+
+    std::error_code ec;
+    auto last_pruned = fs::last_write_time(stamp_path, ec);
+    if (!ec && now - last_pruned < prune_interval) {
+        return;
+    }
+    write_file(stamp_path, "");
+
+    auto remove_if_old = [&](const fs::path& path) {
+        std::error_code time_ec;
+        auto time = fs::last_write_time(path, time_ec);
+        if (!time_ec && now - time > max_file_age) {
+            fs::remove(path, time_ec);
+        }
+    };
+
+    // another worker may remove the same files at once
+    try {
+        for (const auto& entry : fs::directory_iterator(dir, ec)) {
+            auto name = entry.path().filename().string();
+            if (name.starts_with("generation-") ||
+                name.starts_with("markers-")) {
+                remove_if_old(entry.path());
+            }
+        }
+        for (const auto& entry : fs::directory_iterator(dir / "git", ec)) {
+            remove_if_old(entry.path());
+        }
+    } catch (const fs::filesystem_error&) {
+    }
+}
+
+}  // namespace async
@@ -113,3 +113,21 @@ Config get_config() {
         };
     }
 }
+
+fs::path get_runtime_dir() {
+    auto runtime_dir = get_env("XDG_RUNTIME_DIR");
+    if (!runtime_dir.empty()) {
+        return fs::path(runtime_dir) / "zprompt";
+    }
+
+    return get_cache_dir();
+}
+
+fs::path get_cache_dir() {
+    auto cache_dir = get_env("XDG_CACHE_HOME");
+    if (!cache_dir.empty()) {
+        return fs::path(cache_dir) / "zprompt";
+    }
+
+    return fs::path(get_env("HOME")) / ".cache" / "zprompt";
+}
@@ -0,0 +1,53 @@
+#include "zprompt.hpp"
+
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <string>
+#include <system_error>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+std::string get_env(const char* name) {
+    const char* env = getenv(name);
+    if (env == nullptr) {
+        return "";
+    }
+    return env;
+}
+
+}  // namespace
+
+// an empty cwd when it is gone, which the prompt shows as unknown
+Context get_context(int return_code) {
+    std::error_code ec;
+    auto cwd = fs::current_path(ec);
+
+    return {
+        .cwd = ec ? fs::path() : cwd,
+        .return_code = return_code,
+        .home = get_env("HOME"),
+        .ssh_connection = get_env("SSH_CONNECTION"),
+        .virtual_env = get_env("VIRTUAL_ENV"),
+        .virtual_env_prompt = get_env("VIRTUAL_ENV_PROMPT"),
+    };
+}
+
+std::string format_prompt(const Config& config, const Context& context,
+                          MarkerCache& markers, const std::string& git_status,
+                          Profiler& profiler) {
+    auto ssh_status =
+        profiler.time("ssh", [&] { return get_ssh_status(config, context); });
+    auto cwd = profiler.time("cwd", [&] {
+        return get_current_directory(config, context, markers);
+    });
+    auto venv_status =
+        profiler.time("venv", [&] { return get_venv_status(config, context); });
+    auto return_code = profiler.time(
+        "ret", [&] { return get_return_code(config, context.return_code); });
+
+    return std::format("{}{}{}\n{}{}", ssh_status, cwd, git_status,
+                       venv_status, return_code);
+}
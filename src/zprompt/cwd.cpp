@@ -1,64 +1,222 @@
 #include "zprompt.hpp"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
-#include <cstdlib>
-#include <cstring>
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
+#include <fstream>
+#include <optional>
 #include <ranges>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 namespace fs = std::filesystem;
 
 namespace {
 
-bool has_marker(const fs::path& dir,
-                const std::vector<std::string>& pwd_markers) {
-    return std::ranges::any_of(pwd_markers, [&](const std::string& marker) {
-        return fs::exists(dir / marker);
-    });
+// directories larger than this are probed for each marker with fstatat
+// rather than read whole
+constexpr off_t max_scan_size = 64 * 1024;
+
+// a cache past this size is started over
+constexpr std::size_t max_cache_entries = 4096;
+
+constexpr uint64_t cache_magic = 0x314b524d505a;  // "ZPMRK1"
+
+// closes the descriptor when it goes out of scope
+class FileDescriptor {
+public:
+    explicit FileDescriptor(int fd = -1) : fd_(fd) {}
+    ~FileDescriptor() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+    FileDescriptor(FileDescriptor&&) = delete;
+    FileDescriptor& operator=(FileDescriptor&&) = delete;
+
+    void reset(int fd) {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+        fd_ = fd;
+    }
+
+    [[nodiscard]] int get() const {
+        return fd_;
+    }
+
+private:
+    int fd_;
+};
+
+MarkerCache::Key make_key(const struct stat& st) {
+    return {
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+        .mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                    st.st_mtim.tv_nsec,
+    };
+}
+
+// FNV-1a of the marker names, so the cache of another config is dropped
+uint64_t hash_markers(const std::vector<std::string>& markers) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const auto& marker : markers) {
+        // with the terminating NUL, so the names can't run together
+        for (auto c : std::string_view(marker.c_str(), marker.size() + 1)) {
+            h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+        }
+    }
+    return h;
+}
+
+using Record = std::array<uint64_t, 4>;
+
+void write_record(std::ofstream& file, const Record& record) {
+    file.write(reinterpret_cast<const char*>(record.data()), sizeof(Record));
 }
 
+bool read_record(std::ifstream& file, Record& record) {
+    return static_cast<bool>(
+        file.read(reinterpret_cast<char*>(record.data()), sizeof(Record)));
+}
+
+// walks down the path one component at a time with openat, so each
+// directory is looked up once instead of once per marker
+class MarkerFinder {
+public:
+    MarkerFinder(const std::vector<std::string>& markers, MarkerCache& cache)
+        : markers_(markers),
+          marker_set_(markers.begin(), markers.end()),
+          cache_(cache) {}
+
+    // the directory to start from
+    void open_base(const fs::path& path) {
+        dir_fd_.reset(open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    }
+
+    // moves into the part, falling back to the full path when the parent
+    // could not be opened, and tells whether it holds a marker
+    bool enter(const fs::path& part, const fs::path& path) {
+        constexpr int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+        dir_fd_.reset(dir_fd_.get() >= 0
+                          ? openat(dir_fd_.get(), part.c_str(), flags)
+                          : open(path.c_str(), flags));
+        return dir_fd_.get() >= 0 && has_marker(dir_fd_.get());
+    }
+
+private:
+    bool has_marker(int fd) {
+        struct stat st = {};
+        if (fstat(fd, &st) != 0) {
+            return false;
+        }
+
+        auto key = make_key(st);
+        if (auto found = cache_.find(key)) {
+            return *found;
+        }
+
+        auto found = st.st_size <= max_scan_size ? scan(fd) : probe(fd);
+        cache_.store(key, found);
+        return found;
+    }
+
+    // reads the entries with getdents64 and looks each name up
+    [[nodiscard]] bool scan(int fd) const {
+        std::array<char, 32 * 1024> buf{};
+        ssize_t n = 0;
+        while ((n = getdents64(fd, buf.data(), buf.size())) > 0) {
+            for (ssize_t pos = 0; pos < n;) {
+                const auto* entry =
+                    reinterpret_cast<const struct dirent64*>(&buf.at(pos));
+                if (marker_set_.contains(std::string_view(entry->d_name))) {
+                    return true;
+                }
+                pos += entry->d_reclen;
+            }
+        }
+        return false;
+    }
+
+    [[nodiscard]] bool probe(int fd) const {
+        struct stat st = {};
+        return std::ranges::any_of(markers_, [&](const std::string& marker) {
+            return fstatat(fd, marker.c_str(), &st, 0) == 0;
+        });
+    }
+
+    const std::vector<std::string>& markers_;
+    std::unordered_set<std::string_view> marker_set_;
+    MarkerCache& cache_;
+    FileDescriptor dir_fd_;
+};
+
 bool is_subpath(const fs::path& base, const fs::path& path) {
     auto base_size = std::distance(base.begin(), base.end());
     return std::ranges::equal(base, path | std::views::take(base_size));
 }
 
+void append_part(std::string& result, const fs::path& part, bool is_anchor,
+                 const Config& config) {
+    if (is_anchor) {
+        result += color_wrap(config.color_pwd_normal, "/") +
+                  color_wrap(config.color_pwd_anchor, part.string());
+    } else {
+        result += color_wrap(config.color_pwd_normal, "/" + part.string());
+    }
+}
+
 std::string format_path(const fs::path& home_path, const fs::path& pwd_path,
-                        const Config& config) {
+                        const Config& config, MarkerCache& markers) {
     std::string result = color_wrap(config.color_pwd_normal, "~");
 
     if (home_path == pwd_path) {
         return result;
     }
 
+    MarkerFinder finder(config.pwd_markers, markers);
+    finder.open_base(home_path);
+
     auto accumulated_path = home_path;
 
     for (const auto& part : fs::relative(pwd_path, home_path)) {
         accumulated_path /= part;
-        if (has_marker(accumulated_path, config.pwd_markers)) {
-            result += color_wrap(config.color_pwd_normal, "/") +
-                      color_wrap(config.color_pwd_anchor, part.string());
-        } else {
-            result += color_wrap(config.color_pwd_normal, "/" + part.string());
-        }
+        append_part(result, part, finder.enter(part, accumulated_path),
+                    config);
     }
 
     return result;
 }
 
-std::string format_path(const fs::path& pwd_path, const Config& config) {
+std::string format_path(const fs::path& pwd_path, const Config& config,
+                        MarkerCache& markers) {
     std::string result;
+
+    MarkerFinder finder(config.pwd_markers, markers);
+    finder.open_base("/");
+
     auto accumulated_path = fs::path("/");
 
     for (const auto& part : pwd_path | std::views::drop(1)) {
         accumulated_path /= part;
-        if (has_marker(accumulated_path, config.pwd_markers)) {
-            result += color_wrap(config.color_pwd_normal, "/") +
-                      color_wrap(config.color_pwd_anchor, part.string());
-        } else {
-            result += color_wrap(config.color_pwd_normal, "/" + part.string());
-        }
+        append_part(result, part, finder.enter(part, accumulated_path),
+                    config);
     }
 
     return result;
@@ -66,19 +224,104 @@ std::string format_path(const fs::path& pwd_path, const Config& config) {
 
 }  // namespace
 
-std::string get_current_directory(const Config& config) {
+MarkerCache::MarkerCache(const std::vector<std::string>& markers,
+                         fs::path path)
+    : path_(std::move(path)), markers_hash_(hash_markers(markers)) {
+    if (!path_.empty()) {
+        load();
+    }
+}
+
+MarkerCache MarkerCache::for_session(const std::vector<std::string>& markers) {
+    return MarkerCache(
+        markers, get_runtime_dir() / ("markers-" + std::to_string(getsid(0))));
+}
+
+std::size_t MarkerCache::KeyHash::operator()(const Key& key) const {
+    auto h = key.ino * 0x9e3779b97f4a7c15ULL;
+    h ^= key.dev + (h << 6) + (h >> 2);
+    h ^= static_cast<uint64_t>(key.mtime_ns) + (h << 6) + (h >> 2);
+    return h;
+}
+
+std::optional<bool> MarkerCache::find(const Key& key) const {
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+void MarkerCache::store(const Key& key, bool has_marker) {
+    if (entries_.size() >= max_cache_entries) {
+        entries_.clear();
+    }
+    entries_[key] = has_marker;
+    is_dirty_ = true;
+}
+
+// written to a new file and renamed over the old one, so a prompt of
+// another session sharing it never reads half of it
+void MarkerCache::save() const {
+    if (path_.empty() || !is_dirty_) {
+        return;
+    }
+
+    std::error_code ec;
+    fs::create_directories(path_.parent_path(), ec);
+
+    auto tmp_path = path_;
+    tmp_path += ".tmp." + std::to_string(getpid());
+    {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        write_record(file, {cache_magic, markers_hash_, 0, 0});
+        for (const auto& [key, has_marker] : entries_) {
+            write_record(file, {key.dev, key.ino,
+                                static_cast<uint64_t>(key.mtime_ns),
+                                has_marker ? 1U : 0U});
+        }
+        if (!file) {
+            fs::remove(tmp_path, ec);
+            return;
+        }
+    }
+    fs::rename(tmp_path, path_, ec);
+}
+
+void MarkerCache::load() {
+    std::ifstream file(path_, std::ios::binary);
+    Record record = {};
+    if (!read_record(file, record) || record[0] != cache_magic ||
+        record[1] != markers_hash_) {
+        return;
+    }
+
+    while (read_record(file, record)) {
+        Key key = {
+            .dev = record[0],
+            .ino = record[1],
+            .mtime_ns = static_cast<int64_t>(record[2]),
+        };
+        entries_[key] = record[3] != 0;
+    }
+}
+
+std::string get_current_directory(const Config& config, const Context& context,
+                                  MarkerCache& markers) {
     try {
-        auto pwd_path = fs::current_path();
+        const auto& pwd_path = context.cwd;
+        if (pwd_path.empty()) {
+            return color_wrap(config.color_pwd_error, "unknown");
+        }
 
-        const auto* home_env = getenv("HOME");
-        if (home_env != nullptr && strlen(home_env) > 0) {
-            auto home_path = fs::path(home_env);
+        if (!context.home.empty()) {
+            auto home_path = fs::path(context.home);
             if (is_subpath(home_path, pwd_path)) {
-                return format_path(home_path, pwd_path, config);
+                return format_path(home_path, pwd_path, config, markers);
             }
         }
 
-        return format_path(pwd_path, config);
+        return format_path(pwd_path, config, markers);
     } catch (const fs::filesystem_error& e) {
         return color_wrap(config.color_pwd_error, "unknown");
     }
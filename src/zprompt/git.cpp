@@ -1,8 +1,8 @@
 #include "zprompt.hpp"
 
+#include <filesystem>
 #include <optional>
 #include <string>
-#include <vector>
 
 #include <git2.h>
 
@@ -18,77 +18,65 @@ std::optional<std::string> get_branch_name(git_reference* head_ref) {
     return std::nullopt;
 }
 
-std::vector<std::string> get_tags(git_repository* repo,
-                                  const git_oid* head_oid) {
-    std::vector<std::string> tags;
-    git_reference_iterator* iter = nullptr;
-    git_reference* ref = nullptr;
-    const git_oid* tag_target_oid = nullptr;
+std::string get_commit_hash(const git_oid* head_oid) {
+    constexpr auto short_oid_len = 9;
+    auto commit_hash = std::string(git_oid_tostr_s(head_oid), short_oid_len);
+    return commit_hash;
+}
 
-    if (git_reference_iterator_glob_new(&iter, repo, "refs/tags/*") != 0) {
-        return {};
-    }
+}  // namespace
 
-    while (git_reference_next(&ref, iter) != GIT_ITEROVER) {
-        git_object* tag_peel = nullptr;
+std::optional<std::string> get_git_status(const Config& config,
+                                          git_repository* repo,
+                                          const CancelCheck& is_cancelled) {
+    std::optional<std::string> result = "";
 
-        if (git_reference_peel(&tag_peel, ref, GIT_OBJECT_COMMIT) == 0) {
-            tag_target_oid = git_object_id(tag_peel);
+    git_reference* head_ref = nullptr;
 
-            if (git_oid_cmp(head_oid, tag_target_oid) == 0) {
-                tags.emplace_back(git_reference_shorthand(ref));
+    if (is_cancelled()) {
+        result = std::nullopt;
+    } else if (git_repository_head(&head_ref, repo) == 0) {
+        auto branch_name = get_branch_name(head_ref);
+        if (branch_name.has_value()) {
+            result = color_wrap(config.color_git, " " + branch_name.value());
+        } else {
+            const auto* head_oid = git_reference_target(head_ref);
+
+            auto tags = tag_index::find(repo, head_oid);
+            if (!tags.empty()) {
+                for (auto& tag : tags) {
+                    *result += " #" + color_wrap(config.color_git, tag);
+                }
+            } else {
+                auto commit_hash = get_commit_hash(head_oid);
+                result = " @" + color_wrap(config.color_git, commit_hash);
             }
-
-            git_object_free(tag_peel);
         }
-
-        git_reference_free(ref);
+        git_reference_free(head_ref);
     }
 
-    git_reference_iterator_free(iter);
-
-    return tags;
-}
-
-std::string get_commit_hash(const git_oid* head_oid) {
-    constexpr auto short_oid_len = 9;
-    auto commit_hash = std::string(git_oid_tostr_s(head_oid), short_oid_len);
-    return commit_hash;
+    return result;
 }
 
-}  // namespace
-
-std::string get_git_status(const Config& config) {
-    std::string result;
+std::optional<std::string> get_git_status(const Config& config,
+                                          const std::filesystem::path& cwd,
+                                          const CancelCheck& is_cancelled) {
+    std::optional<std::string> result = "";
 
     git_repository* repo = nullptr;
-    git_reference* head_ref = nullptr;
 
     git_libgit2_init();
 
-    if (git_repository_open_ext(&repo, ".", 0, nullptr) == 0) {
-        if (git_repository_head(&head_ref, repo) == 0) {
-            auto branch_name = get_branch_name(head_ref);
-            if (branch_name.has_value()) {
-                result =
-                    color_wrap(config.color_git, " " + branch_name.value());
-            } else {
-                const auto* head_oid = git_reference_target(head_ref);
-
-                if (auto tags = get_tags(repo, head_oid); !tags.empty()) {
-                    for (auto& tag : tags) {
-                        result += " #" + color_wrap(config.color_git, tag);
-                    }
-                } else {
-                    auto commit_hash = get_commit_hash(head_oid);
-                    result = " @" + color_wrap(config.color_git, commit_hash);
-                }
-            }
-            git_reference_free(head_ref);
-        }
+    if (git_repository_open_ext(&repo, cwd.c_str(), 0, nullptr) == 0) {
+        result = get_git_status(config, repo, is_cancelled);
         git_repository_free(repo);
     }
     git_libgit2_shutdown();
 
     return result;
 }
+
+std::string get_git_status(const Config& config,
+                           const std::filesystem::path& cwd) {
+    return *get_git_status(config, cwd, [] { return false; });
+}
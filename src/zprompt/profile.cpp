@@ -0,0 +1,165 @@
+#include "zprompt.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// bucket i holds the times below 2^(i+1) microseconds that the one before
+// it doesn't, and the last one everything longer
+constexpr std::size_t num_buckets = 32;
+using Histogram = std::array<uint64_t, num_buckets>;
+
+// past this many samples every count is halved, so the histogram follows
+// the recent prompts rather than every prompt there ever was
+constexpr uint64_t max_samples = 10000;
+
+bool is_set(const char* name) {
+    const char* env = getenv(name);
+    return env != nullptr && *env != '\0' && std::string_view(env) != "0";
+}
+
+fs::path histogram_path(const char* part) {
+    return get_cache_dir() / "profile" / part;
+}
+
+std::size_t bucket_of(std::chrono::nanoseconds duration) {
+    auto us = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(duration)
+            .count());
+    return std::min<std::size_t>(std::bit_width(us >> 1), num_buckets - 1);
+}
+
+Histogram load_histogram(const fs::path& path) {
+    Histogram histogram = {};
+    std::ifstream file(path, std::ios::binary);
+    if (!file.read(reinterpret_cast<char*>(histogram.data()),
+                   sizeof(histogram))) {
+        return {};
+    }
+    return histogram;
+}
+
+// written to a new file and renamed over the old one, so a prompt of
+// another session never reads half of it. one of two prompts saving at
+// once loses its sample, which a histogram can spare
+void save_histogram(const fs::path& path, const Histogram& histogram) {
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+
+    auto tmp_path = path;
+    tmp_path += ".tmp." + std::to_string(getpid());
+    {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(histogram.data()),
+                   sizeof(histogram));
+        if (!file) {
+            fs::remove(tmp_path, ec);
+            return;
+        }
+    }
+    fs::rename(tmp_path, path, ec);
+}
+
+void add_sample(Histogram& histogram, std::chrono::nanoseconds duration) {
+    if (std::accumulate(histogram.begin(), histogram.end(), uint64_t{0}) >=
+        max_samples) {
+        for (auto& count : histogram) {
+            count /= 2;
+        }
+    }
+    ++histogram[bucket_of(duration)];
+}
+
+// the upper bound of the bucket the quantile falls in
+std::optional<double> quantile_ms(const Histogram& histogram, double q) {
+    auto total = std::accumulate(histogram.begin(), histogram.end(),
+                                 uint64_t{0});
+    if (total == 0) {
+        return std::nullopt;
+    }
+
+    auto rank = q * static_cast<double>(total);
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < num_buckets; ++i) {
+        seen += histogram[i];
+        if (static_cast<double>(seen) >= rank) {
+            return static_cast<double>(uint64_t{1} << (i + 1)) / 1000;
+        }
+    }
+    return static_cast<double>(uint64_t{1} << num_buckets) / 1000;
+}
+
+std::string format_ms(std::optional<double> ms) {
+    return ms ? std::format("{:.3f}", *ms) : "-";
+}
+
+}  // namespace
+
+Profiler Profiler::from_env(bool is_printed) {
+    return {is_printed || is_set("ZPROMPT_PROFILE"),
+            is_set("ZPROMPT_PROFILE_HISTOGRAM")};
+}
+
+void Profiler::report() const {
+    std::vector<Histogram> histograms;
+    if (is_recorded_) {
+        for (const auto& [part, duration] : timings_) {
+            auto path = histogram_path(part);
+            auto& histogram = histograms.emplace_back(load_histogram(path));
+            add_sample(histogram, duration);
+            save_histogram(path, histogram);
+        }
+    }
+
+    if (!is_printed_) {
+        return;
+    }
+
+    auto to_ms = [](std::chrono::nanoseconds duration) {
+        return std::chrono::duration<double, std::milli>(duration).count();
+    };
+
+    std::cerr << std::format("{:<10} {:>9}", "part", "ms");
+    if (is_recorded_) {
+        std::cerr << std::format(" {:>9} {:>9} {:>9}", "p50 ms", "p90 ms",
+                                 "p99 ms");
+    }
+    std::cerr << '\n';
+
+    std::chrono::nanoseconds total{0};
+    for (std::size_t i = 0; i < timings_.size(); ++i) {
+        const auto& [part, duration] = timings_[i];
+        total += duration;
+
+        std::cerr << std::format("{:<10} {:>9.3f}", part, to_ms(duration));
+        if (is_recorded_) {
+            const auto& histogram = histograms[i];
+            std::cerr << std::format(" {:>9} {:>9} {:>9}",
+                                     format_ms(quantile_ms(histogram, 0.5)),
+                                     format_ms(quantile_ms(histogram, 0.9)),
+                                     format_ms(quantile_ms(histogram, 0.99)));
+        }
+        std::cerr << '\n';
+    }
+    std::cerr << std::format("{:<10} {:>9.3f}\n", "total", to_ms(total));
+}
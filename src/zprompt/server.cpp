@@ -0,0 +1,595 @@
+#include "zprompt.hpp"
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <list>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <git2.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// a server this slow is treated as absent and the prompt is made locally
+constexpr int client_timeout_ms = 200;
+
+constexpr std::string_view protocol_version = "zprompt1";
+// the version and the six fields of the context
+constexpr std::size_t num_fields = 7;
+constexpr std::size_t max_request_size = 64 * 1024;
+
+// repositories beyond this many are closed, least recently used first
+constexpr std::size_t max_repos = 16;
+
+constexpr int poll_timeout_ms = 500;
+
+// the names in a git directory the git segment depends on
+constexpr std::array<std::string_view, 2> git_dir_names = {"HEAD",
+                                                           "packed-refs"};
+
+constexpr uint32_t watch_mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+                                IN_MOVE_SELF | IN_ONLYDIR;
+
+std::atomic<bool> stop_requested = false;
+
+void request_stop(int /*signum*/) {
+    stop_requested = true;
+}
+
+bool write_all(int fd, const char* data, std::size_t size) {
+    while (size > 0) {
+        auto n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// reads until count NULs have arrived, so the other side can keep the
+// connection open for the reply
+bool read_fields(int fd, std::string& data, std::size_t count,
+                 std::size_t max_size) {
+    std::array<char, 4096> buf{};
+    auto num_nuls = static_cast<std::size_t>(std::ranges::count(data, '\0'));
+    while (num_nuls < count) {
+        auto n = recv(fd, buf.data(), buf.size(), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || data.size() + n > max_size) {
+            return false;
+        }
+        auto chunk = std::string_view(buf.data(), n);
+        num_nuls += std::ranges::count(chunk, '\0');
+        data.append(chunk);
+    }
+    return true;
+}
+
+sockaddr_un make_address(const fs::path& path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+void set_timeout(int fd) {
+    timeval tv = {.tv_sec = 0, .tv_usec = client_timeout_ms * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+int connect_server() {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    set_timeout(fd);
+
+    auto addr = make_address(server::socket_path());
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int listen_socket() {
+    auto path = server::socket_path();
+
+    // a socket file nobody answers on is left over from a dead server
+    if (int fd = connect_server(); fd >= 0) {
+        close(fd);
+        return -1;
+    }
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    unlink(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    constexpr int backlog = 64;
+
+    auto addr = make_address(path);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        listen(fd, backlog) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+std::string encode(const Context& context) {
+    auto return_code = std::to_string(context.return_code);
+
+    std::string data;
+    for (std::string_view field : {
+             std::string_view(protocol_version),
+             std::string_view(context.cwd.native()),
+             std::string_view(return_code),
+             std::string_view(context.home),
+             std::string_view(context.ssh_connection),
+             std::string_view(context.virtual_env),
+             std::string_view(context.virtual_env_prompt),
+         }) {
+        data.append(field);
+        data.push_back('\0');
+    }
+    return data;
+}
+
+std::optional<Context> decode(std::string_view data) {
+    std::vector<std::string_view> fields;
+    while (fields.size() < num_fields) {
+        auto end = data.find('\0');
+        if (end == std::string_view::npos) {
+            return std::nullopt;
+        }
+        fields.push_back(data.substr(0, end));
+        data.remove_prefix(end + 1);
+    }
+
+    if (fields[0] != protocol_version) {
+        return std::nullopt;
+    }
+
+    Context context = {
+        .cwd = fs::path(fields[1]),
+        .return_code = 0,
+        .home = std::string(fields[3]),
+        .ssh_connection = std::string(fields[4]),
+        .virtual_env = std::string(fields[5]),
+        .virtual_env_prompt = std::string(fields[6]),
+    };
+    try {
+        context.return_code = std::stoi(std::string(fields[2]));
+    } catch (const std::exception&) {
+        return std::nullopt;
+    }
+    return context;
+}
+
+// an open repository and its git segment, until a change to HEAD or the
+// refs drops it
+struct Repo {
+    std::string git_dir;
+    git_repository* repo;
+    std::optional<std::string> git_status;
+    std::vector<int> wds;
+};
+
+// the repositories that depend on a watched directory
+struct Watch {
+    fs::path path;
+    // only HEAD and packed-refs matter in a git directory, while any entry
+    // of refs/heads, refs/tags and the directories below them does
+    bool is_git_dir;
+    // a directory below refs/heads or refs/tags. the one above it reports
+    // its removal, so the repositories stay open when it goes
+    bool is_nested;
+    std::vector<std::string> git_dirs;
+};
+
+class Server {
+public:
+    Server()
+        : config_(get_config()),
+          markers_(config_.pwd_markers),
+          inotify_fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+        git_libgit2_init();
+
+        // the directory get_config reads zprompt.toml from
+        if (const char* home = getenv("HOME"); home != nullptr) {
+            auto config_dir = fs::path(home) / ".config" / "tools";
+            config_wd_ =
+                inotify_add_watch(inotify_fd_, config_dir.c_str(), watch_mask);
+        }
+    }
+
+    ~Server() {
+        for (auto& repo : repos_) {
+            git_repository_free(repo.repo);
+        }
+        close(inotify_fd_);
+        git_libgit2_shutdown();
+    }
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+    Server(Server&&) = delete;
+    Server& operator=(Server&&) = delete;
+
+    [[nodiscard]] int inotify_fd() const {
+        return inotify_fd_;
+    }
+
+    void handle(int fd);
+    void process_events();
+
+private:
+    std::string get_git_status(const fs::path& cwd);
+    Repo* open_repo(const std::string& git_dir);
+    void watch(Repo& repo, const fs::path& path, bool is_git_dir,
+               bool is_nested);
+    void watch_refs(Repo& repo, const fs::path& path, bool is_nested);
+    void unwatch(int wd);
+    void close_repo(std::list<Repo>::iterator it);
+    void invalidate(const Watch& watch);
+    void reload_config();
+
+    Config config_;
+    MarkerCache markers_;
+
+    // most recently used first
+    std::list<Repo> repos_;
+    std::unordered_map<int, Watch> watches_;
+
+    int inotify_fd_;
+    int config_wd_ = -1;
+};
+
+void Server::handle(int fd) {
+    std::string data;
+    if (!read_fields(fd, data, num_fields, max_request_size)) {
+        return;
+    }
+
+    auto context = decode(data);
+    if (!context) {
+        return;
+    }
+
+    // the changes made before the request was sent are queued by now
+    process_events();
+
+    Profiler profiler;
+    auto prompt = format_prompt(config_, *context, markers_,
+                                get_git_status(context->cwd), profiler);
+    prompt.push_back('\0');
+    write_all(fd, prompt.data(), prompt.size());
+}
+
+std::string Server::get_git_status(const fs::path& cwd) {
+    // the same lookup git_repository_open_ext does, without opening it
+    git_buf buf = {};
+    if (cwd.empty() ||
+        git_repository_discover(&buf, cwd.c_str(), 0, nullptr) != 0) {
+        return "";
+    }
+    std::string git_dir(buf.ptr, buf.size);
+    git_buf_dispose(&buf);
+
+    auto* repo = open_repo(git_dir);
+    if (repo == nullptr) {
+        return "";
+    }
+
+    if (!repo->git_status) {
+        repo->git_status =
+            ::get_git_status(config_, repo->repo, [] { return false; });
+    }
+    return repo->git_status.value_or("");
+}
+
+Repo* Server::open_repo(const std::string& git_dir) {
+    auto it = std::ranges::find(repos_, git_dir, &Repo::git_dir);
+    if (it != repos_.end()) {
+        repos_.splice(repos_.begin(), repos_, it);
+        return &repos_.front();
+    }
+
+    git_repository* git_repo = nullptr;
+    if (git_repository_open(&git_repo, git_dir.c_str()) != 0) {
+        return nullptr;
+    }
+
+    if (repos_.size() >= max_repos) {
+        close_repo(std::prev(repos_.end()));
+    }
+
+    auto& repo = repos_.emplace_front(Repo{
+        .git_dir = git_dir,
+        .repo = git_repo,
+        .git_status = std::nullopt,
+        .wds = {},
+    });
+
+    // watched before the segment is made, so no change can slip between
+    fs::path common_dir = git_repository_commondir(git_repo);
+    watch(repo, git_dir, true, false);
+    watch(repo, common_dir, true, false);
+    watch_refs(repo, common_dir / "refs" / "heads", false);
+    watch_refs(repo, common_dir / "refs" / "tags", false);
+
+    return &repo;
+}
+
+void Server::watch(Repo& repo, const fs::path& path, bool is_git_dir,
+                   bool is_nested) {
+    int wd = inotify_add_watch(inotify_fd_, path.c_str(), watch_mask);
+    if (wd < 0 || std::ranges::find(repo.wds, wd) != repo.wds.end()) {
+        return;
+    }
+
+    auto& watch = watches_[wd];
+    watch.path = path;
+    watch.is_git_dir = is_git_dir;
+    watch.is_nested = is_nested;
+    watch.git_dirs.push_back(repo.git_dir);
+    repo.wds.push_back(wd);
+}
+
+// refs such as refs/tags/release/v1 live in directories of their own,
+// which inotify doesn't watch along with the one above. a directory is
+// watched before it is listed, so one made in between is still seen
+void Server::watch_refs(Repo& repo, const fs::path& path, bool is_nested) {
+    watch(repo, path, false, is_nested);
+
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(path, ec)) {
+        if (entry.is_directory(ec) && !entry.is_symlink(ec)) {
+            watch_refs(repo, entry.path(), true);
+        }
+    }
+}
+
+// drops a watch of every repository that has it
+void Server::unwatch(int wd) {
+    for (auto& repo : repos_) {
+        std::erase(repo.wds, wd);
+    }
+    inotify_rm_watch(inotify_fd_, wd);
+    watches_.erase(wd);
+}
+
+void Server::close_repo(std::list<Repo>::iterator it) {
+    for (int wd : it->wds) {
+        auto watch_it = watches_.find(wd);
+        if (watch_it == watches_.end()) {
+            continue;
+        }
+        std::erase(watch_it->second.git_dirs, it->git_dir);
+        if (watch_it->second.git_dirs.empty()) {
+            inotify_rm_watch(inotify_fd_, wd);
+            watches_.erase(watch_it);
+        }
+    }
+    git_repository_free(it->repo);
+    repos_.erase(it);
+}
+
+void Server::invalidate(const Watch& watch) {
+    for (auto& repo : repos_) {
+        if (std::ranges::find(watch.git_dirs, repo.git_dir) !=
+            watch.git_dirs.end()) {
+            repo.git_status.reset();
+        }
+    }
+}
+
+// the colors and markers may have changed, so everything made with the
+// old config goes
+void Server::reload_config() {
+    config_ = get_config();
+    markers_ = MarkerCache(config_.pwd_markers);
+    for (auto& repo : repos_) {
+        repo.git_status.reset();
+    }
+}
+
+void Server::process_events() {
+    alignas(inotify_event) std::array<char, 16 * 1024> buf{};
+    ssize_t n = 0;
+    while ((n = read(inotify_fd_, buf.data(), buf.size())) > 0) {
+        for (ssize_t pos = 0; pos < n;) {
+            const auto* event =
+                reinterpret_cast<const inotify_event*>(&buf.at(pos));
+            pos += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+
+            auto name = event->len > 0 ? std::string_view(event->name)
+                                       : std::string_view();
+
+            // events were lost, so nothing made so far can be trusted. the
+            // repositories are opened and watched again on the next prompt,
+            // as ref directories made meanwhile have no watches
+            if ((event->mask & IN_Q_OVERFLOW) != 0) {
+                reload_config();
+                while (!repos_.empty()) {
+                    close_repo(repos_.begin());
+                }
+                continue;
+            }
+
+            if (event->wd == config_wd_) {
+                if (name == "zprompt.toml") {
+                    reload_config();
+                }
+                continue;
+            }
+
+            auto it = watches_.find(event->wd);
+            if (it == watches_.end()) {
+                continue;
+            }
+
+            bool is_gone = (event->mask & (IN_IGNORED | IN_DELETE_SELF |
+                                           IN_MOVE_SELF)) != 0;
+
+            // a ref directory that went away only takes its own watch
+            if (is_gone && it->second.is_nested) {
+                invalidate(it->second);
+                unwatch(event->wd);
+                continue;
+            }
+
+            // any other directory that went away takes the repositories
+            // with it, and they are opened again on the next prompt
+            if (is_gone) {
+                auto git_dirs = it->second.git_dirs;
+                for (const auto& git_dir : git_dirs) {
+                    auto repo_it = std::ranges::find(repos_, git_dir,
+                                                     &Repo::git_dir);
+                    if (repo_it != repos_.end()) {
+                        close_repo(repo_it);
+                    }
+                }
+                continue;
+            }
+
+            // a new ref directory is watched for the refs made in it
+            if (!it->second.is_git_dir && (event->mask & IN_ISDIR) != 0 &&
+                (event->mask & (IN_CREATE | IN_MOVED_TO)) != 0) {
+                auto path = it->second.path / name;
+                auto git_dirs = it->second.git_dirs;
+                for (const auto& git_dir : git_dirs) {
+                    auto repo_it = std::ranges::find(repos_, git_dir,
+                                                     &Repo::git_dir);
+                    if (repo_it != repos_.end()) {
+                        watch_refs(*repo_it, path, true);
+                    }
+                }
+                it = watches_.find(event->wd);
+            }
+
+            if (!it->second.is_git_dir ||
+                std::ranges::find(git_dir_names, name) !=
+                    git_dir_names.end()) {
+                invalidate(it->second);
+            }
+        }
+    }
+}
+
+}  // namespace
+
+namespace server {
+
+fs::path socket_path() {
+    return get_runtime_dir() / "zprompt.sock";
+}
+
+int serve() {
+    int listen_fd = listen_socket();
+    if (listen_fd < 0) {
+        std::cerr << "can't listen on " << socket_path().string() << '\n';
+        return 1;
+    }
+
+    struct sigaction sa = {};
+    sa.sa_handler = request_stop;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    {
+        Server server;
+
+        std::array<pollfd, 2> pfds = {{
+            {.fd = listen_fd, .events = POLLIN, .revents = 0},
+            {.fd = server.inotify_fd(), .events = POLLIN, .revents = 0},
+        }};
+        while (!stop_requested) {
+            if (poll(pfds.data(), pfds.size(), poll_timeout_ms) <= 0) {
+                continue;
+            }
+
+            if ((pfds[1].revents & POLLIN) != 0) {
+                server.process_events();
+            }
+            if ((pfds[0].revents & POLLIN) == 0) {
+                continue;
+            }
+
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                continue;
+            }
+            set_timeout(fd);
+            server.handle(fd);
+            close(fd);
+        }
+    }
+
+    close(listen_fd);
+    unlink(socket_path().c_str());
+
+    return 0;
+}
+
+std::optional<std::string> request(const Context& context) {
+    int fd = connect_server();
+    if (fd < 0) {
+        return std::nullopt;
+    }
+
+    constexpr std::size_t max_reply_size = 1 << 20;
+
+    auto data = encode(context);
+    std::string reply;
+    bool ok = write_all(fd, data.data(), data.size()) &&
+              read_fields(fd, reply, 1, max_reply_size);
+    close(fd);
+
+    if (!ok) {
+        return std::nullopt;
+    }
+    reply.resize(reply.find('\0'));
+    return reply;
+}
+
+}  // namespace server
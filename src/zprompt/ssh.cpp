@@ -4,7 +4,6 @@
 #include <unistd.h>
 
 #include <array>
-#include <cstring>
 #include <string>
 
 namespace {
@@ -23,11 +22,10 @@ std::string get_hostname() {
 
 }  // namespace
 
-std::string get_ssh_status(const Config& config) {
+std::string get_ssh_status(const Config& config, const Context& context) {
     std::string result;
 
-    const char* ssh_env = std::getenv("SSH_CONNECTION");
-    if (ssh_env != nullptr && strlen(ssh_env) > 0) {
+    if (!context.ssh_connection.empty()) {
         auto user = get_username();
         auto host = get_hostname();
 
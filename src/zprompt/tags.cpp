@@ -0,0 +1,477 @@
+#include "zprompt.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <git2.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr uint64_t index_magic = 0x31474154505a;  // "ZPTAG1"
+
+constexpr std::string_view tags_prefix = "refs/tags/";
+
+constexpr std::size_t oid_size = sizeof(git_oid::id);
+using Oid = std::array<unsigned char, oid_size>;
+
+Oid to_oid(const git_oid* oid) {
+    Oid result{};
+    std::memcpy(result.data(), oid->id, oid_size);
+    return result;
+}
+
+// object ids are uniformly distributed already
+uint64_t hash_oid(const Oid& oid) {
+    uint64_t h = 0;
+    std::memcpy(&h, oid.data(), sizeof(h));
+    return h;
+}
+
+struct OidHash {
+    std::size_t operator()(const Oid& oid) const {
+        return hash_oid(oid);
+    }
+};
+
+// the index file is this header, the stamps, an open addressing table of
+// slots and the names the stamps and slots point into
+struct IndexHeader {
+    uint64_t magic;
+    uint64_t num_stamps;
+    // a power of two, with at least one slot empty
+    uint64_t num_slots;
+    uint64_t names_size;
+};
+
+// packed-refs or a directory under refs/tags as it was when the index was
+// built. adding, removing or replacing a loose tag changes the mtime of
+// its directory, and git pack-refs replaces packed-refs
+struct Stamp {
+    uint64_t ino;
+    int64_t mtime_ns;
+    int64_t size;
+    uint32_t path_offset;
+    uint32_t path_size;
+
+    [[nodiscard]] bool same_file(const Stamp& other) const {
+        return ino == other.ino && mtime_ns == other.mtime_ns &&
+               size == other.size;
+    }
+};
+
+// a commit and its tags, each ending with a NUL, or empty when it has none
+struct Slot {
+    Oid oid;
+    uint32_t names_offset;
+    uint32_t num_names;
+};
+
+Stamp make_stamp(const fs::path& path) {
+    struct stat st = {};
+    if (stat(path.c_str(), &st) != 0) {
+        return {
+            .ino = 0,
+            .mtime_ns = 0,
+            .size = -1,
+            .path_offset = 0,
+            .path_size = 0,
+        };
+    }
+    return {
+        .ino = st.st_ino,
+        .mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                    st.st_mtim.tv_nsec,
+        .size = st.st_size,
+        .path_offset = 0,
+        .path_size = 0,
+    };
+}
+
+fs::path index_path(const fs::path& common_dir) {
+    return get_cache_dir() / "tags" /
+           std::format("{:016x}",
+                       std::hash<std::string>{}(common_dir.string()));
+}
+
+// written to a new file and renamed over the old one, so a reader never
+// maps half of it
+void write_file(const fs::path& path, const std::string& data) {
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+
+    auto tmp_path = path;
+    tmp_path += ".tmp." + std::to_string(getpid());
+    {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        file << data;
+        if (!file) {
+            fs::remove(tmp_path, ec);
+            return;
+        }
+    }
+    fs::rename(tmp_path, path, ec);
+}
+
+std::optional<Oid> peel_to_commit(git_repository* repo, const git_oid* oid) {
+    std::optional<Oid> result;
+
+    git_object* obj = nullptr;
+    git_object* commit = nullptr;
+    if (git_object_lookup(&obj, repo, oid, GIT_OBJECT_ANY) == 0) {
+        if (git_object_peel(&commit, obj, GIT_OBJECT_COMMIT) == 0) {
+            result = to_oid(git_object_id(commit));
+            git_object_free(commit);
+        }
+        git_object_free(obj);
+    }
+
+    return result;
+}
+
+std::optional<git_oid> parse_oid(std::string_view hex) {
+    git_oid oid = {};
+    if (hex.size() < 2 * oid_size ||
+        git_oid_fromstrn(&oid, hex.data(), 2 * oid_size) != 0) {
+        return std::nullopt;
+    }
+    return oid;
+}
+
+// reads the tags of a repository the way git itself stores them, so only
+// the tags with no peeled id in packed-refs are looked up in the object
+// database
+class IndexBuilder {
+public:
+    IndexBuilder(git_repository* repo, fs::path common_dir)
+        : repo_(repo), common_dir_(std::move(common_dir)) {}
+
+    void build() {
+        // taken first, so a tag changed while the index is built leaves it
+        // stale rather than wrong
+        add_stamp("packed-refs");
+        add_stamp("refs/tags");
+
+        read_packed_refs();
+        read_loose_tags();
+
+        for (const auto& [name, commit] : tags_) {
+            if (commit) {
+                commit_tags_[*commit].push_back(
+                    name.substr(tags_prefix.size()));
+            }
+        }
+    }
+
+    [[nodiscard]] std::vector<std::string> find(const Oid& oid) const {
+        auto it = commit_tags_.find(oid);
+        return it != commit_tags_.end() ? it->second
+                                        : std::vector<std::string>();
+    }
+
+    [[nodiscard]] std::string encode() const;
+
+private:
+    void add_stamp(const std::string& path) {
+        stamps_.emplace_back(path, make_stamp(common_dir_ / path));
+    }
+
+    void read_packed_refs();
+    void read_loose_tags();
+
+    git_repository* repo_;
+    fs::path common_dir_;
+
+    std::vector<std::pair<std::string, Stamp>> stamps_;
+    // by full ref name, which a loose tag shares with the packed one it
+    // overrides. nothing when it doesn't peel to a commit
+    std::map<std::string, std::optional<Oid>> tags_;
+    std::unordered_map<Oid, std::vector<std::string>, OidHash> commit_tags_;
+};
+
+// each line is an id and a ref name, and with the peeled trait a tag
+// object is followed by a line with ^ and the id it peels to
+void IndexBuilder::read_packed_refs() {
+    std::ifstream file(common_dir_ / "packed-refs");
+
+    bool is_peeled = false;
+    std::optional<git_oid> pending_oid;
+    std::string pending_name;
+
+    auto resolve_pending = [&] {
+        if (pending_oid) {
+            tags_[pending_name] =
+                is_peeled ? std::optional<Oid>(to_oid(&*pending_oid))
+                          : peel_to_commit(repo_, &*pending_oid);
+            pending_oid.reset();
+        }
+    };
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.starts_with('#')) {
+            auto traits = line + ' ';
+            is_peeled = traits.find(" peeled ") != std::string::npos ||
+                        traits.find(" fully-peeled ") != std::string::npos;
+        } else if (line.starts_with('^')) {
+            if (auto peeled = parse_oid(std::string_view(line).substr(1));
+                peeled && pending_oid) {
+                tags_[pending_name] = to_oid(&*peeled);
+                pending_oid.reset();
+            }
+        } else {
+            resolve_pending();
+
+            auto oid = parse_oid(line);
+            auto name = std::string_view(line).substr(
+                std::min(line.size(), 2 * oid_size + 1));
+            if (oid && name.starts_with(tags_prefix)) {
+                pending_oid = oid;
+                pending_name = name;
+            }
+        }
+    }
+    resolve_pending();
+}
+
+void IndexBuilder::read_loose_tags() {
+    std::error_code ec;
+    auto tags_dir = common_dir_ / "refs" / "tags";
+    for (auto it = fs::recursive_directory_iterator(tags_dir, ec);
+         !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        auto path = it->path().lexically_relative(common_dir_).string();
+
+        if (it->is_directory(ec)) {
+            add_stamp(path);
+            continue;
+        }
+        if (path.ends_with(".lock")) {
+            continue;
+        }
+
+        git_oid oid = {};
+        if (git_reference_name_to_id(&oid, repo_, path.c_str()) == 0) {
+            tags_[path] = peel_to_commit(repo_, &oid);
+        }
+    }
+}
+
+std::string IndexBuilder::encode() const {
+    auto num_slots =
+        std::bit_ceil(std::max<std::size_t>(2 * commit_tags_.size(), 1));
+    std::vector<Slot> slots(num_slots);
+
+    std::string names;
+    std::vector<Stamp> stamps;
+    for (const auto& [path, stamp] : stamps_) {
+        auto& s = stamps.emplace_back(stamp);
+        s.path_offset = static_cast<uint32_t>(names.size());
+        s.path_size = static_cast<uint32_t>(path.size());
+        names += path;
+    }
+
+    for (const auto& [oid, tags] : commit_tags_) {
+        auto i = hash_oid(oid) & (num_slots - 1);
+        while (slots[i].num_names != 0) {
+            i = (i + 1) & (num_slots - 1);
+        }
+        slots[i] = {
+            .oid = oid,
+            .names_offset = static_cast<uint32_t>(names.size()),
+            .num_names = static_cast<uint32_t>(tags.size()),
+        };
+        for (const auto& tag : tags) {
+            names += tag;
+            names.push_back('\0');
+        }
+    }
+
+    IndexHeader header = {
+        .magic = index_magic,
+        .num_stamps = stamps.size(),
+        .num_slots = num_slots,
+        .names_size = names.size(),
+    };
+
+    std::string data;
+    data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    data.append(reinterpret_cast<const char*>(stamps.data()),
+                stamps.size() * sizeof(Stamp));
+    data.append(reinterpret_cast<const char*>(slots.data()),
+                slots.size() * sizeof(Slot));
+    data.append(names);
+    return data;
+}
+
+// the index file mapped read-only, or nothing when it is missing or
+// doesn't look like one
+class MappedIndex {
+public:
+    explicit MappedIndex(const fs::path& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+
+        struct stat st = {};
+        if (fstat(fd, &st) == 0 &&
+            static_cast<std::size_t>(st.st_size) >= sizeof(IndexHeader)) {
+            size_ = st.st_size;
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+            data_ = data != MAP_FAILED ? static_cast<const char*>(data)
+                                       : nullptr;
+        }
+        close(fd);
+
+        if (data_ != nullptr && !check_layout()) {
+            munmap(const_cast<char*>(data_), size_);
+            data_ = nullptr;
+        }
+    }
+
+    ~MappedIndex() {
+        if (data_ != nullptr) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    MappedIndex(const MappedIndex&) = delete;
+    MappedIndex& operator=(const MappedIndex&) = delete;
+    MappedIndex(MappedIndex&&) = delete;
+    MappedIndex& operator=(MappedIndex&&) = delete;
+
+    [[nodiscard]] bool is_open() const {
+        return data_ != nullptr;
+    }
+
+    [[nodiscard]] bool is_fresh(const fs::path& common_dir) const {
+        for (uint64_t i = 0; i < header_.num_stamps; ++i) {
+            auto stamp = read_at<Stamp>(stamps_offset + i * sizeof(Stamp));
+            if (stamp.path_offset > names_.size() ||
+                stamp.path_size > names_.size() - stamp.path_offset) {
+                return false;
+            }
+            auto path = names_.substr(stamp.path_offset, stamp.path_size);
+            if (!stamp.same_file(make_stamp(common_dir / path))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    [[nodiscard]] std::vector<std::string> find(const Oid& oid) const {
+        std::vector<std::string> tags;
+
+        auto mask = header_.num_slots - 1;
+        for (auto i = hash_oid(oid) & mask;; i = (i + 1) & mask) {
+            auto slot = read_at<Slot>(slots_offset_ + i * sizeof(Slot));
+            if (slot.num_names == 0) {
+                return tags;
+            }
+            if (slot.oid != oid) {
+                continue;
+            }
+
+            auto pos = static_cast<std::size_t>(slot.names_offset);
+            for (uint32_t n = 0; n < slot.num_names && pos < names_.size();
+                 ++n) {
+                auto end = names_.find('\0', pos);
+                if (end == std::string_view::npos) {
+                    break;
+                }
+                tags.emplace_back(names_.substr(pos, end - pos));
+                pos = end + 1;
+            }
+            return tags;
+        }
+    }
+
+private:
+    static constexpr std::size_t stamps_offset = sizeof(IndexHeader);
+
+    template <typename T>
+    T read_at(std::size_t offset) const {
+        T value;
+        std::memcpy(&value, data_ + offset, sizeof(value));
+        return value;
+    }
+
+    // the sizes must add up to the file, and the table must have an empty
+    // slot for a lookup to end on
+    bool check_layout() {
+        header_ = read_at<IndexHeader>(0);
+        if (header_.magic != index_magic || header_.num_slots == 0 ||
+            !std::has_single_bit(header_.num_slots) ||
+            header_.num_stamps > size_ / sizeof(Stamp) ||
+            header_.num_slots > size_ / sizeof(Slot)) {
+            return false;
+        }
+
+        slots_offset_ = stamps_offset + header_.num_stamps * sizeof(Stamp);
+        auto names_offset = slots_offset_ + header_.num_slots * sizeof(Slot);
+        if (names_offset > size_ ||
+            size_ - names_offset != header_.names_size) {
+            return false;
+        }
+        names_ = std::string_view(data_ + names_offset, header_.names_size);
+
+        for (uint64_t i = 0; i < header_.num_slots; ++i) {
+            if (read_at<Slot>(slots_offset_ + i * sizeof(Slot)).num_names ==
+                0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+    IndexHeader header_ = {};
+    std::size_t slots_offset_ = 0;
+    std::string_view names_;
+};
+
+}  // namespace
+
+namespace tag_index {
+
+// a stale index is built again in full, even when the prompt it is for
+// has been replaced, as the next prompt would need it just the same
+std::vector<std::string> find(git_repository* repo, const git_oid* oid) {
+    fs::path common_dir = git_repository_commondir(repo);
+    auto path = index_path(common_dir);
+
+    if (MappedIndex index(path);
+        index.is_open() && index.is_fresh(common_dir)) {
+        return index.find(to_oid(oid));
+    }
+
+    IndexBuilder builder(repo, common_dir);
+    builder.build();
+    write_file(path, builder.encode());
+    return builder.find(to_oid(oid));
+}
+
+}  // namespace tag_index